@@ -0,0 +1,26 @@
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+#include <sys/types.h>
+
+/*
+ * Get the PROT_, MAP_ and MS_ constants from the kernel
+ */
+#include <kern/mman.h>
+
+/*
+ * Map LEN bytes of the open file FILEHANDLE starting at OFFSET (a
+ * multiple of the page size). ADDR is only a hint and is currently
+ * ignored. Pages are read from the file when first touched. With
+ * MAP_SHARED, writes go back to the file on msync, sync, munmap and
+ * exit, and every process mapping the file sees the same pages.
+ *
+ * munmap removes whole mappings; a range that splits a mapping is
+ * rejected. msync writes back the shared mappings in the range.
+ */
+void *mmap(void *addr, size_t len, int prot, int flags, int filehandle,
+	   off_t offset);
+int munmap(void *addr, size_t len);
+int msync(void *addr, size_t len, int flags);
+
+#endif /* _SYS_MMAN_H_ */
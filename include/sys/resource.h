@@ -0,0 +1,18 @@
+#ifndef _SYS_RESOURCE_H_
+#define _SYS_RESOURCE_H_
+
+#include <sys/types.h>
+
+/*
+ * Get RUSAGE_ constants and struct rusage from the kernel
+ */
+#include <kern/resource.h>
+
+/*
+ * Fill in USAGE with the CPU time, time spent waiting to run, context
+ * switches and page faults of the calling process (RUSAGE_SELF) or of
+ * all its children that have been waited for (RUSAGE_CHILDREN).
+ */
+int getrusage(int who, struct rusage *usage);
+
+#endif /* _SYS_RESOURCE_H_ */
@@ -24,12 +24,16 @@
  *        is not set. To completely invalidate the TLB, load it with
  *        translations for addresses in one of the unmapped address
  *        ranges - these will never be matched.
+ *
+ *   TLB_SetPID: set the address space ID that user translations are
+ *        matched against. The other functions preserve it.
  */
 
 void TLB_Random(u_int32_t entryhi, u_int32_t entrylo);
 void TLB_Write(u_int32_t entryhi, u_int32_t entrylo, u_int32_t index);
 void TLB_Read(u_int32_t *entryhi, u_int32_t *entrylo, u_int32_t index);
 int TLB_Probe(u_int32_t entryhi, u_int32_t entrylo);
+void TLB_SetPID(u_int32_t pid);
 
 // Helper to flush TLB
 #define TLB_Flush()\
@@ -41,10 +45,11 @@ int TLB_Probe(u_int32_t entryhi, u_int32_t entrylo);
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
- * bits that aren't assigned a meaning.
+ * The MIPS has support for a 6-bit address space ID. Every address
+ * space gets one from as_activate, and entries are written with it in
+ * TLBHI_PID so they survive context switches. PID 0 is never handed
+ * out. TLBLO_GLOBAL is left zero, as are the bits that aren't assigned
+ * a meaning.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
  * ever set by the processor. If you set it, writes are permitted. If
@@ -56,7 +61,8 @@ int TLB_Probe(u_int32_t entryhi, u_int32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
@@ -79,5 +85,11 @@ int TLB_Probe(u_int32_t entryhi, u_int32_t entrylo);
 
 #define NUM_TLB  64
 
+/*
+ * Number of address space IDs.
+ */
+
+#define NUM_TLB_PID  64
+
 
 #endif /* _MACHINE_TLB_H_ */
@@ -101,6 +101,28 @@ mips_syscall(struct trapframe *tf)
         case SYS___time:
         err = sys___time((time_t *)tf->tf_a0, (unsigned long *)tf->tf_a1, &retval);
         break;
+        case SYS_open:
+        err = sys_open((const char *)tf->tf_a0, (int)tf->tf_a1, &retval);
+        break;
+        case SYS_close:
+        err = sys_close((int)tf->tf_a0);
+        break;
+        case SYS_sync:
+        err = sys_sync();
+        break;
+        case SYS_mmap:
+        err = sys_mmap((void *)tf->tf_a0, (size_t)tf->tf_a1, (int)tf->tf_a2, (int)tf->tf_a3,
+                       (userptr_t)(tf->tf_sp + 16), (void **)&retval);
+        break;
+        case SYS_munmap:
+        err = sys_munmap((void *)tf->tf_a0, (size_t)tf->tf_a1);
+        break;
+        case SYS_msync:
+        err = sys_msync((void *)tf->tf_a0, (size_t)tf->tf_a1, (int)tf->tf_a2);
+        break;
+        case SYS_getrusage:
+        err = sys_getrusage((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+        break;
         default:
         kprintf("Unknown syscall %d\n", callno);
         err = ENOSYS;
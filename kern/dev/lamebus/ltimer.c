@@ -22,6 +22,9 @@
 
 static int haveclock=0;
 
+/* The timer doing hardclock, so its period can be changed. */
+static struct ltimer_softc *hardclock_lt;
+
 /*
  * Setup routine called by autoconf stuff when an ltimer is found.
  */
@@ -35,6 +38,7 @@ config_ltimer(struct ltimer_softc *lt, int ltimerno)
 	if (!haveclock) {
 		haveclock = 1;
 		lt->lt_hardclock = 1;
+		hardclock_lt = lt;
 
 		/*
 		 * Arm the timer to go off HZ times a second, and set
@@ -58,6 +62,21 @@ config_ltimer(struct ltimer_softc *lt, int ltimerno)
 	return 0;
 }
 
+/*
+ * Make the hardclock timer go off every TICKS ticks from now on.
+ * Writing the count restarts the countdown.
+ */
+void
+hardclock_setinterval(unsigned int ticks)
+{
+	assert(ticks > 0);
+	if (hardclock_lt == NULL) {
+		return;
+	}
+	bus_write_register(hardclock_lt->lt_bus, hardclock_lt->lt_buspos,
+			   LT_REG_COUNT, ticks * (LT_GRANULARITY/HZ));
+}
+
 /*
  * Interrupt handler.
  */
@@ -20,6 +20,9 @@ static int
 sfs_loadvnode(struct sfs_fs *sfs, u_int32_t ino, int type,
 		 struct sfs_vnode **ret);
 
+/* Where in-memory vnodes come from. */
+static struct kmem_cache *sfs_vnode_cache;
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -917,7 +920,7 @@ sfs_reclaim(struct vnode *v)
 	VOP_KILL(&sv->sv_v);
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	kmem_cache_free(sfs_vnode_cache, sv);
 
 	/* Done */
 	return 0;
@@ -1579,7 +1582,17 @@ sfs_loadvnode(struct sfs_fs *sfs, u_int32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	/* All SFS mounts share one cache, made on first use. */
+	if (sfs_vnode_cache == NULL) {
+		sfs_vnode_cache = kmem_cache_create("sfs_vnode",
+						    sizeof(struct sfs_vnode),
+						    NULL, NULL);
+		if (sfs_vnode_cache == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	sv = kmem_cache_alloc(sfs_vnode_cache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -1593,7 +1606,7 @@ sfs_loadvnode(struct sfs_fs *sfs, u_int32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1630,7 +1643,7 @@ sfs_loadvnode(struct sfs_fs *sfs, u_int32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1641,7 +1654,7 @@ sfs_loadvnode(struct sfs_fs *sfs, u_int32_t ino, int forcetype,
 	result = array_add(sfs->sfs_vnodes, sv);
 	if (result) {
 		VOP_KILL(&sv->sv_v);
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
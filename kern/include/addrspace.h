@@ -10,22 +10,43 @@ struct vnode;
 
 struct page_table_entry {
     u_int32_t vframe : 20; // 32 - 12 = 20
-    u_int32_t pframe : 20; // 32 - 12 = 20
     u_int32_t permission : 3; // *nix style permission
     u_int32_t cow : 1; // 0 means that tlb entry should be dirty, 1 means that tlb should not be dirty(readonly)
     u_int32_t swapped : 1; // Indicates if this page is in memory or in swap file
-    u_int32_t swap_file_frame : 16; // File frame for the page in swap
+    u_int32_t valid : 1; // Indicates if this slot of the page table holds a page
+    u_int32_t dirty : 1; // Page was written since it was loaded, TLB entries are read-only until this is set
+    union {
+        u_int32_t pframe : 20; // Physical frame for the page when it is in memory
+        u_int32_t swap_file_frame : 20; // File frame for the page in swap(when swapped is set)
+    };
 };
 
+/*
+ * Two-level page table, the same split MIPS would use with 8 byte entries.
+ * The top level directory has one pointer for every PT_L2_ENTRIES pages of
+ * user space, each second level table is exactly one page of inline entries.
+ * Tables never move once allocated, so coremap can keep pointers to entries.
+ */
+#define PT_L2_BITS 9
+#define PT_L2_ENTRIES (1 << PT_L2_BITS)
+#define PT_L1_ENTRIES ((USERTOP >> PAGE_SHIFT) >> PT_L2_BITS)
+#define PT_L1_INDEX(vaddr) ((vaddr) >> (PAGE_SHIFT + PT_L2_BITS))
+#define PT_L2_INDEX(vaddr) (((vaddr) >> PAGE_SHIFT) & (PT_L2_ENTRIES - 1))
+
 // This defines how each segment exist in the addrspace
+// Code, data, heap and stack are all segments, as_segments keeps them sorted by vbase and never overlapping
 struct as_segment {
     vaddr_t vbase;
     size_t npages;
     u_int32_t permission; // We use *nix style permission 0-7
-    struct vnode *vnode; // Used for on-demand paging
+    struct vnode *vnode; // Used for on-demand paging, NULL for anonymous segments (heap, stack) that start out zeroed
     struct uio uio; // Used for on-demand paging
+    unsigned int flags; // AS_SEG_ flags below
 };
 
+#define AS_SEG_MMAP   1 // Made by mmap, holds a reference on vnode and can be unmapped
+#define AS_SEG_SHARED 2 // Writes go back to the file, pages are shared with every other mapping of it
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -41,11 +62,25 @@ struct addrspace {
     size_t as_npages2;
     paddr_t as_stackpbase;
 #else
-    struct array *as_segments;
+    struct array *as_segments; // Sorted by vbase, searched with as_segment_lookup
+    struct as_segment *as_heap; // The heap segment in as_segments, grown by sbrk
     vaddr_t as_heapbase;
     size_t as_heapsize;
     vaddr_t as_stackbase;
-    struct array *page_table;
+    struct page_table_entry **page_dir; // PT_L1_ENTRIES pointers to second level tables
+    struct lock *as_lock; // Serializes faults and page table changes of this address space, held across disk I/O
+    unsigned int as_asid; // TLB address space ID, only meaningful while as_asid_generation is current
+    unsigned int as_asid_generation;
+    vaddr_t as_ra_next; // Where the next disk fault lands if access is sequential
+    unsigned int as_ra_window; // Pages to read ahead after a disk fault, grows on sequential faults and shrinks otherwise
+    unsigned int as_rss; // Resident pages mapped, a page shared with other address spaces counts for each of them
+    unsigned int as_rss_limit; // Resident pages above this are trimmed first(0 for no limit)
+    unsigned int as_ws; // Working set estimate, pages the clock found referenced in its last full sweep
+    unsigned int as_ws_refs; // Referenced pages found so far in the current sweep
+    unsigned int as_ws_sweep; // Clock sweep as_ws_refs belongs to
+    unsigned int as_ws_created; // Clock sweep the address space was created in
+    unsigned int as_faults; // Faults the fast refill couldn't resolve
+    unsigned int as_major_faults; // Faults that had to wait for the disk
 #endif
 };
 
@@ -81,8 +116,27 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *                Also sets up the (empty) heap region right after the
+ *                highest region defined so far.
+ *
+ *    as_bootstrap - set up the object caches address spaces and their
+ *                regions are allocated from. Called from vm_bootstrap.
+ *
+ *    as_define_mapping - map LEN bytes of a file from OFFSET (page
+ *                aligned) into the highest free range below the stack.
+ *                Pages are read on demand. A SHARED mapping writes its
+ *                pages back to the file and shares them with every other
+ *                mapping of the file. Hands back the address.
+ *
+ *    as_unmap  - remove the mappings in a range, writing back shared
+ *                ones first. Only whole mappings can be removed.
+ *
+ *    as_sync   - write back the shared mappings overlapping a range.
+ *
+ *    The last three are called with as_lock held.
  */
 
+void              as_bootstrap(void);
 struct addrspace *as_create(void);
 int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(struct addrspace *);
@@ -96,6 +150,47 @@ int               as_define_region(struct addrspace *as,
 int       as_prepare_load(struct addrspace *as);
 int       as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_define_mapping(struct addrspace *as, struct vnode *v,
+                   off_t offset, size_t len,
+                   unsigned int permission, int shared,
+                   vaddr_t *ret);
+int               as_unmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_sync(struct addrspace *as, vaddr_t vaddr, size_t len);
+
+/*
+ * Page table functions in addrspace.c:
+ *
+ *    as_pte_lookup - find the page table entry for a page of the address
+ *                space in constant time. Returns NULL if the page has not
+ *                been touched yet.
+ *
+ *    as_pte_create - get the (not yet valid) slot for a page, allocating
+ *                the second level table if needed. Returns NULL on
+ *                out-of-memory error.
+ *
+ *    as_tlbhi  - TLB entryhi for a page of the address space, tagged with
+ *                its ASID. Only valid for the active address space.
+ *
+ *    as_tlb_unload - drop the TLB entry for a page of the address space,
+ *                whether or not the address space is the active one.
+ *
+ *    as_segment_lookup - find the segment containing an address with a
+ *                binary search over as_segments. Returns NULL if the
+ *                address is in no segment.
+ *
+ *    as_segment_resize - change the size of a segment in place. Fails
+ *                with ENOMEM if it would run into the next segment.
+ *
+ *    as_swapped_pages - count the pages of the address space that are in
+ *                swap, walking the whole page table.
+ */
+struct as_segment       *as_segment_lookup(struct addrspace *as, vaddr_t vaddr);
+int                      as_segment_resize(struct addrspace *as, struct as_segment *seg, size_t npages);
+struct page_table_entry *as_pte_lookup(struct addrspace *as, vaddr_t vaddr);
+struct page_table_entry *as_pte_create(struct addrspace *as, vaddr_t vaddr);
+u_int32_t                as_tlbhi(struct addrspace *as, vaddr_t vaddr);
+void                     as_tlb_unload(struct addrspace *as, vaddr_t vaddr);
+unsigned int             as_swapped_pages(struct addrspace *as);
 
 /*
  * Functions in loadelf.c
@@ -109,7 +204,7 @@ int load_elf(struct vnode *v, vaddr_t *entrypoint);
 // The on-demand version of load_elf
 int load_elf_on_demand(struct vnode *v, vaddr_t *entrypoint);
 
-// Load a page from a segment
-int load_page_on_demand(struct vnode *v, struct uio u, off_t page_offset);
+// Load a page from a segment straight into a physical page
+int load_page_on_demand(struct vnode *v, struct uio u, off_t page_offset, paddr_t paddr);
 
 #endif /* _ADDRSPACE_H_ */
@@ -22,6 +22,20 @@
 
 void hardclock(void);
 
+/*
+ * Tickless idle. The scheduler calls hardclock_idle before it waits for
+ * an interrupt with nothing to run, and hardclock_resume once it has
+ * something again. While idle the timer only goes off at the next real
+ * deadline, and the ticks skipped meanwhile are caught up from the time
+ * of day clock.
+ *
+ * hardclock_setinterval is provided by the timer driver and sets the
+ * timer period in ticks.
+ */
+void hardclock_idle(void);
+void hardclock_resume(void);
+void hardclock_setinterval(unsigned int ticks);
+
 void gettime(time_t *seconds, u_int32_t *nanoseconds);
 
 void getinterval(time_t secs1, u_int32_t nsecs,
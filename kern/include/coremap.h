@@ -3,16 +3,33 @@
 
 #include <addrspace.h>
 
-#define MAX_SHARED_PAGE 24
+struct vnode;
+
+// Reverse mapping, one node for every pte that maps a user page
+struct rmap {
+    struct addrspace *as; // Address space the pte belongs to
+    struct page_table_entry *pte;
+    struct rmap *next; // Next mapping of the same page
+};
 
 struct coremap_entry {
-    //struct addrspace *as; // Which address space does this page belongs to
     unsigned int status : 1; // Indicate if this page is being used or not
     unsigned int kernel : 1; // Indicate un-swappable kernel page
     unsigned int block_page_count : 14; // Number of pages in the block following this page(include this page)
-    unsigned int ref_count : 6; // Reference count to a physical page, the page should only be freed when ref_count is 0(Allows for 65535 reference should be enough)
-    //unsigned int pt_index : 16; // Index of the page in the page table
-    struct page_table_entry *ptes[MAX_SHARED_PAGE]; // Use to backtrack to pte
+    unsigned int ref_count : 16; // Reference count to a physical page, the page should only be freed when ref_count is 0(Allows for 65535 reference should be enough)
+    unsigned int referenced : 1; // Software reference bit for the clock hand, set whenever the page gets loaded into TLB
+    unsigned int file_backed : 1; // Page was loaded from the executable and can be read again from there while clean
+    unsigned int busy : 1; // Page is pinned: being read or written, or copied from, the clock skips it and faults on it wait
+    unsigned int prefetched : 1; // Page was read ahead and nobody touched it yet
+    unsigned int zeroed : 1; // Free page already filled with zeroes, only valid when status is 0
+    unsigned int zero_fill : 1; // Prefaulted anonymous page nobody wrote to yet, eviction maps the zero page again
+    struct vnode *file_vnode; // File of a shared mapping page, written back there instead of to swap(NULL if none)
+    off_t file_offset; // Where the page sits in file_vnode
+    int file_next; // Next page in the same file page hash bucket(-1 if last), only valid when file_vnode is set
+    int swap_slot; // Swap slot still holding a copy of this page(-1 if none), only kept while the page is clean
+    int free_next; // Next page on the free page list(-1 if last), only valid when status is 0
+    int free_prev; // Previous page on the free page list(-1 if first), only valid when status is 0
+    struct rmap *rmap; // Every pte mapping this page(ref_count of them), NULL for kernel pages
 };
 
 extern struct coremap_entry *coremap;
@@ -25,26 +42,29 @@ void coremap_init(void);
 // Print physical page usage
 int coremap_stats(int nargs, char **arg);
 
-// Get current max number of pages that can be allocated
+// Get current max number of pages that can be allocated(constant time, the count is cached)
 unsigned int coremap_get_avail_page_count(void);
 
 // The following two function should not be used directly
 // Use the kernel/user macros instead
 ///////////////////////////////////////////
-// Allocate mutiple physical page
+// Allocate mutiple physical page, 0 if no run of free or evictable pages is left or swap is full
 paddr_t coremap_alloc_pages(int npages, unsigned int kernel_or_user, struct page_table_entry *pte);
 
-// Allocate a single physical page
-paddr_t coremap_alloc_page(unsigned int kernel_or_user, struct page_table_entry *pte);
+// Allocate a single physical page, user pages come back busy until the caller has filled them in
+// A zeroed page comes from the pre-zeroed pool if it has any, otherwise it is zeroed here
+// Returns 0 if a user page's rmap node can't be allocated or memory and swap are both full
+paddr_t coremap_alloc_page(unsigned int kernel_or_user, struct addrspace *as, struct page_table_entry *pte, unsigned int zeroed);
 ///////////////////////////////////////////
 
 #define coremap_alloc_kpages(npages) coremap_alloc_pages(npages, 1, NULL)
-//#define coremap_alloc_kpages(npages) coremap_alloc_page(1, NULL)
-#define coremap_alloc_kpage() coremap_alloc_page(1, NULL)
+//#define coremap_alloc_kpages(npages) coremap_alloc_page(1, NULL, NULL)
+#define coremap_alloc_kpage() coremap_alloc_page(1, NULL, NULL, 0)
 
 // This should never be called
 //#define coremap_alloc_upages(npages, pte) coremap_alloc_pages(npages, 0, pte)
-#define coremap_alloc_upage(pte) coremap_alloc_page(0, pte)
+#define coremap_alloc_upage(as, pte) coremap_alloc_page(0, as, pte, 0)
+#define coremap_alloc_zeroed_upage(as, pte) coremap_alloc_page(0, as, pte, 1)
 
 // Free multiple physical page(dec ref count first, if 0 free)
 void coremap_free_pages(paddr_t paddr, struct page_table_entry *pte);
@@ -52,8 +72,9 @@ void coremap_free_pages(paddr_t paddr, struct page_table_entry *pte);
 // Free a single physical page(dec ref count first, if 0 free)
 #define coremap_free_page(paddr, pte) coremap_free_pages(paddr, pte)
 
-// Increase the page reference count
-void coremap_inc_page_ref_count(paddr_t paddr);
+// Map a page into one more pte(copy-on-write sharing), this increases the page reference count
+// Returns ENOMEM if the rmap node can't be allocated, the pte isn't mapped then
+int coremap_page_share(paddr_t paddr, struct addrspace *as, struct page_table_entry *pte);
 
 // Returns the reference count of a physical page
 unsigned int coremap_get_page_ref_count(paddr_t paddr);
@@ -62,10 +83,75 @@ unsigned int coremap_get_page_ref_count(paddr_t paddr);
 void coremap_page_swap_in(paddr_t paddr, struct page_table_entry *pte);
 void coremap_page_swap_out(paddr_t paddr);
 
-// Find a page to evict
+// Mark a physical page as recently used(called when a TLB entry for it is loaded)
+void coremap_page_referenced(paddr_t paddr);
+
+// Invalidate the TLB entries of every mapping of a physical page
+void coremap_page_unload(unsigned int pframe);
+
+// The shared zero page, mapped copy-on-write by untouched stack and heap pages
+// Sharing and freeing it are no-ops, it never leaves memory
+paddr_t coremap_zero_page(void);
+
+// Free pages that still have to be zeroed
+unsigned int coremap_get_unzeroed_page_count(void);
+
+// Zero one free page and move it to the pre-zeroed pool, returns 0 if every free page is zeroed already
+int coremap_zero_free_page(void);
+
+// Print zero pool counters
+void coremap_zero_stats(void);
+
+// Page loaded from the executable, it can be dropped instead of swapped while clean
+void coremap_page_file_backed(paddr_t paddr);
+
+// First write to a clean page, the copy in swap(if any) is stale now
+void coremap_page_dirty(paddr_t paddr);
+
+// Zeroed anonymous page set up ahead of its first touch, while clean it's dropped back to the zero page instead of swapped
+void coremap_page_zero_fill(paddr_t paddr);
+
+// Page of a shared file mapping, it can be found by file and offset until it leaves memory
+// The caller registers it while it's still busy being read, so nobody else reads the same file page meanwhile
+void coremap_page_file_shared(paddr_t paddr, struct vnode *v, off_t offset);
+
+// Page holding a file page for shared mappings, 0 if that file page isn't in memory
+paddr_t coremap_find_file_page(struct vnode *v, off_t offset);
+
+// Get a shared file page ready to be written back, returns 0 if none of its mappings wrote to it
+// Otherwise the page is busy, out of every TLB and all its ptes are clean, the caller clears busy after the write
+int coremap_page_begin_writeback(paddr_t paddr);
+
+// Page was read ahead, it counts as a hit when it gets loaded into TLB and as a miss if it leaves memory untouched
+void coremap_page_prefetched(paddr_t paddr);
+
+// Print read-ahead hit/miss counters
+void coremap_prefetch_stats(void);
+
+// Busy bit of a physical page, set while its content is in flight so nobody maps, evicts or frees it meanwhile
+int coremap_page_busy(paddr_t paddr);
+void coremap_page_set_busy(paddr_t paddr);
+void coremap_page_clear_busy(paddr_t paddr);
+
+// Sleep until the page is not busy anymore, callers look the page up again afterwards
+void coremap_page_wait(paddr_t paddr);
+
+// Sleep until any busy page is released, ENOMEM if there are none to wait for
+int coremap_wait_busy_pages(void);
+
+// Find a page to evict(clock/second-chance), returns an out of range frame if no page can be evicted
+// Address spaces over their resident limit or fair share, or idle for a whole clock sweep, are trimmed first
 unsigned int coremap_page_to_evict(void);
 
-// Find a page to evict(avoidance)
-unsigned int coremap_page_to_evict_avoidance(unsigned int pframe);
+// Start and stop resident set and working set accounting for an address space
+// It must not map any page anymore when it is unregistered
+void coremap_as_register(struct addrspace *as);
+void coremap_as_unregister(struct addrspace *as);
+
+// Working set estimate of an address space, pages the clock found referenced in its last full sweep
+unsigned int coremap_as_ws(struct addrspace *as);
+
+// Number of physical pages managed by coremap
+unsigned int coremap_get_page_count(void);
 
 #endif
@@ -7,5 +7,8 @@
 /* Longest full path name */
 #define PATH_MAX   1024
 
+/* Open files per process, including the three standard handles */
+#define OPEN_MAX   16
+
 
 #endif /* _KERN_LIMITS_H_ */
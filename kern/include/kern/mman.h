@@ -0,0 +1,25 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Constants for mmap, munmap and msync
+ */
+
+/* Protection for mmap: or these together. Same bits as ELF segment flags. */
+#define PROT_NONE     0      /* No access */
+#define PROT_EXEC     1      /* Pages may be executed */
+#define PROT_WRITE    2      /* Pages may be written */
+#define PROT_READ     4      /* Pages may be read */
+
+/* Flags for mmap: choose one of these: */
+#define MAP_SHARED    1      /* Writes go to the file and are seen by other mappers */
+#define MAP_PRIVATE   2      /* Writes stay private to the process */
+
+/* Flags for msync */
+#define MS_ASYNC      1      /* Accepted, writes back synchronously anyway */
+#define MS_SYNC       2      /* Write back before returning */
+
+/* Return value of a failed mmap */
+#define MAP_FAILED    ((void *)-1)
+
+#endif /* _KERN_MMAN_H_ */
@@ -0,0 +1,25 @@
+#ifndef _KERN_RESOURCE_H_
+#define _KERN_RESOURCE_H_
+
+/*
+ * Resource usage reported by getrusage
+ */
+
+/* Whose usage to report */
+#define RUSAGE_SELF      0     /* The calling process */
+#define RUSAGE_CHILDREN  (-1)  /* Its children that were waited for, and theirs */
+
+/*
+ * Times are in milliseconds, counted in scheduler ticks, so they are
+ * only as precise as a tick.
+ */
+struct rusage {
+	unsigned long ru_cputime;    /* Time spent running */
+	unsigned long ru_waittime;   /* Time spent runnable, waiting for the CPU */
+	unsigned long ru_nvcsw;      /* Context switches from sleeping or yielding */
+	unsigned long ru_nivcsw;     /* Context switches from being preempted */
+	unsigned long ru_minflt;     /* Page faults served without I/O */
+	unsigned long ru_majflt;     /* Page faults that waited for the disk */
+};
+
+#endif /* _KERN_RESOURCE_H_ */
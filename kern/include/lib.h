@@ -91,6 +91,19 @@ void *kmalloc(size_t sz);
 void kfree(void *ptr);
 void kheap_printstats(void);
 
+/*
+ * Object caches, for kernel objects allocated and freed all the time.
+ * Alloc and free are O(1). Objects are constructed by CTOR (if not
+ * NULL; nonzero return is an error) when the cache grows, keep their
+ * constructed state while free, and are destroyed by DTOR when the
+ * cache shrinks. kmem_cache_alloc returns NULL if out of memory.
+ */
+struct kmem_cache;
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *), void (*dtor)(void *));
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
 /*
  * C string functions. 
  *
@@ -0,0 +1,23 @@
+#ifndef _PAGEOUT_H_
+#define _PAGEOUT_H_
+
+// Background page-out daemon
+// When the number of free frames drops below the low watermark the daemon evicts pages until it reaches the high watermark,
+// so faulting threads usually find a free frame without having to write to swap themselves
+
+// Start the daemon, called at the end of vm_bootstrap
+void pageout_bootstrap(void);
+
+// Called whenever a frame is taken from the free list, wakes the daemon if we are below the low watermark
+void pageout_notify(void);
+
+// Called when a fault found no free frame and had to evict by itself
+void pageout_stall(void);
+
+// Free frames above the low watermark, speculative allocations(read-ahead) should stay within this
+unsigned int pageout_spare_pages(void);
+
+// Menu command, prints watermarks and statistics, "pd low high" sets the watermarks
+int pageout_stats(int nargs, char **arg);
+
+#endif
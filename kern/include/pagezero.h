@@ -0,0 +1,14 @@
+#ifndef _PAGEZERO_H_
+#define _PAGEZERO_H_
+
+// Idle-time page zeroing
+// Whenever the scheduler has nothing to run, a kernel thread zeroes free frames into the pre-zeroed pool,
+// so demand-zero faults on stack and heap pages usually don't have to zero a page themselves
+
+// Start the zeroing thread, called at the end of vm_bootstrap
+void pagezero_bootstrap(void);
+
+// Called by the scheduler with interrupt disabled when the run queue is empty, wakes the thread if there is work
+void pagezero_idle(void);
+
+#endif
@@ -2,8 +2,13 @@
 #define _PROCESS_H_
 
 #include <types.h>
+#include <kern/limits.h>
+#include <kern/resource.h>
 #include <synch.h>
 #include <thread.h>
+#include <uio.h>
+
+struct vnode;
 
 struct process {
     pid_t pid;
@@ -13,12 +18,17 @@ struct process {
     int exit_code;
     struct thread *p_thread;
     struct semaphore *sem_exit;
+    struct vnode *p_files[OPEN_MAX]; // Open files by handle, the standard handles are the console and stay NULL
+    int p_fmodes[OPEN_MAX]; // O_RDONLY, O_WRONLY or O_RDWR for each open file
+    off_t p_offsets[OPEN_MAX]; // Where the next read or write of each open file goes, a forked child gets its own copy
+    struct rusage p_ru; // Final resource usage, filled in when the process exits
+    struct rusage p_cru; // Usage of children that were waited for, and of their children
 };
 
 // Boot process start sequence
 void process_bootstrap(void);
 
-// Print process related stats
+// Print process related stats, resident set and fault counts included, optionally set a resident set limit
 int process_stats(int nargs, char **arg);
 
 // Helper to create new process
@@ -42,4 +52,26 @@ int process_wait(pid_t pid, int *status);
 // Helper function to execv
 int process_execv(const char *program, unsigned long argc, char **argv);
 
+// Open a file into the first free handle of the current process
+int process_open(char *path, int flags, int *fd);
+
+// Close a handle of the current process
+int process_close(int fd);
+
+// Open file of the current process, NULL if the handle isn't open
+struct vnode *process_file(int fd, int *mode);
+
+// Read or write LEN bytes at USER BUF from or to an open file at its current offset, which moves past them
+// RETVAL is the number of bytes transferred, EBADF if the file isn't open for that
+int process_file_io(int fd, userptr_t buf, size_t len, enum uio_rw rw, int *retval);
+
+// Close every file of the current process, called when its thread exits
+void process_close_files(void);
+
+// Resource usage of the current process(RUSAGE_SELF) or its waited for children(RUSAGE_CHILDREN)
+int process_getrusage(int who, struct rusage *ru);
+
+// Print CPU time, run queue wait and context switches of every process, called by the ss menu command
+void process_cpu_stats(void);
+
 #endif
@@ -9,7 +9,25 @@
  *                     already on the run queue or sleeping, weird things
  *                     may happen. Returns an error code.
  *
- *     print_run_queue - dump the run queue to the console for debugging.
+ *     scheduler_idle - return nonzero if no thread is waiting to run.
+ *
+ *     scheduler_block - note that the specified thread is going to sleep,
+ *                     it moves up a priority level when it wakes up.
+ *
+ *     scheduler_tick - charge timer ticks to the current thread. Returns
+ *                     nonzero if it should yield, because its quantum is
+ *                     up or a thread of a higher priority is runnable.
+ *
+ *     scheduler_set_quantum - set the quantum of the highest priority in
+ *                     ticks, lower priorities get multiples of it.
+ *                     Returns an error code.
+ *
+ *     print_run_queue - dump the run queues of every level to the console
+ *                     for debugging.
+ *
+ *     scheduler_stats - menu command printing tick, idle and context switch
+ *                     counts, a run queue length histogram and the CPU
+ *                     usage of every thread.
  *
  *     scheduler_bootstrap - initialize scheduler data 
  *                           (must happen early in boot)
@@ -22,8 +40,13 @@ struct thread;
 
 struct thread *scheduler(void);
 int make_runnable(struct thread *t);
+int scheduler_idle(void);
+void scheduler_block(struct thread *t);
+int scheduler_tick(int ticks);
+int scheduler_set_quantum(int ticks);
 
 void print_run_queue(void);
+int scheduler_stats(int nargs, char **args);
 
 void scheduler_bootstrap(void);
 int scheduler_preallocate(int numthreads);
@@ -3,7 +3,8 @@
 
 #include <addrspace.h>
 
-extern struct lock *swap_lock;
+// Most pages swap_evict_batch writes with a single request
+#define SWAP_CLUSTER 8
 
 // This function init the swapping functionality of the system (Open swap file and such)
 void swap_init(void);
@@ -11,10 +12,13 @@ void swap_init(void);
 // Find how many page we have left in swapfile
 unsigned int swap_get_avail_page_count(void);
 
-// Load a page from swap file to memory
+// Load a page from swap file to memory, the page is busy(fresh from coremap_alloc_upage) and the caller releases it
+// The disk I/O in here and below runs with interrupt enabled
 void swap_load_page(paddr_t paddr, unsigned int file_frame, struct page_table_entry *pte);
 
-void swap_load_page_without_free(paddr_t paddr, unsigned int file_frame, struct page_table_entry *pte);
+// Load npages(at most SWAP_CLUSTER) pages from consecutive swap pages with one read, used for read-ahead
+// Caller holds the address space lock, the pages are clean afterwards just like swap_load_page
+void swap_load_pages(unsigned int file_frame, unsigned int npages, paddr_t *paddrs, struct page_table_entry **ptes);
 
 // Store a page from memory to swap file
 void swap_store_page(paddr_t paddr, unsigned int file_frame);
@@ -22,16 +26,24 @@ void swap_store_page(paddr_t paddr, unsigned int file_frame);
 // Allocate swap page
 unsigned int swap_alloc_page(void);
 
-// Free swap page
+// Add a user to a swap page, used when a swapped page gets shared by fork
+void swap_share_page(unsigned int file_frame);
+
+// Drop a user of a swap page, the page is freed with its last user
 void swap_free_page(unsigned int file_frame);
 
 // Evict page(Remove a page out of memory and put it into swap) return 0 if success
+// If every candidate is busy this waits for one to be released, and may return without evicting if a page got freed meanwhile
 unsigned int swap_evict(void);
 
-// Evict page(Remove a page out of memory and put it into swap) return 0 if success, avoid a page
-unsigned int swap_evict_avoidance(unsigned int pframe);
-
-// Evict a specific page return 0 of success
+// Evict a specific page return 0 of success, the page must not be busy
 unsigned int swap_evict_specific(unsigned int pframe);
 
+// Evict up to npages(at most SWAP_CLUSTER) pages, dirty ones are written to contiguous swap slots with one request
+// Sets evicted to the number of pages freed, returns 0 if at least one page was freed
+unsigned int swap_evict_batch(unsigned int npages, unsigned int *evicted);
+
+// Print swap usage and eviction counts
+void swap_stats(void);
+
 #endif
@@ -5,6 +5,8 @@
 #ifndef _SYNCH_H_
 #define _SYNCH_H_
 
+#include <thread.h> /* for struct wchan */
+
 /*
  * Dijkstra-style semaphore.
  * Operations:
@@ -21,8 +23,10 @@
 struct semaphore {
     char *name;
     volatile int count;
+    struct wchan wchan; // Threads waiting in P
 };
 
+void              sem_bootstrap(void); /* called from thread_bootstrap */
 struct semaphore *sem_create(const char *name, int initial_count);
 void              P(struct semaphore *);
 void              V(struct semaphore *);
@@ -52,6 +56,7 @@ struct lock {
     char *name;
     volatile unsigned int flag;
     volatile struct thread* holder;
+    struct wchan wchan; // Threads waiting to acquire
 };
 
 struct lock *lock_create(const char *name);
@@ -89,6 +94,7 @@ void         lock_destroy(struct lock *);
 
 struct cv {
     char *name;
+    struct wchan wchan; // Threads in cv_wait
 };
 
 struct cv *cv_create(const char *name);
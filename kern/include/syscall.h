@@ -24,4 +24,19 @@ int sys_getpid(pid_t *retval);
 
 int sys___time(time_t *seconds, unsigned long *nanoseconds, time_t *retval);
 
+int sys_open(const char *path, int flags, int *retval);
+
+int sys_close(int fd);
+
+int sys_sync(void);
+
+// The file handle and offset, mmap's last two arguments, are on the user stack at STACKARGS
+int sys_mmap(void *addr, size_t len, int prot, int flags, userptr_t stackargs, void **retval);
+
+int sys_munmap(void *addr, size_t len);
+
+int sys_msync(void *addr, size_t len, int flags);
+
+int sys_getrusage(int who, userptr_t usage);
+
 #endif /* _SYSCALL_H_ */
@@ -27,6 +27,7 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int lockbench(int, char **);
 
 /* filesystem tests */
 int fstest(int, char **);
@@ -39,6 +40,7 @@ int printfile(int, char **);
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int mallocbench(int, char **);
 int nettest(int, char **);
 
 /* Kernel menu system */
@@ -20,6 +20,16 @@ struct thread {
     struct pcb t_pcb;
     char *t_name;
     const void *t_sleepaddr;
+    struct thread *t_wchan_next; // Next thread on the wait channel we sleep on
+    int t_priority; // Scheduler level, 0 runs first
+    int t_ticks; // Ticks used of the current quantum
+    int t_quantum; // Ticks the thread may run before it yields, set from its level
+    int t_blocked; // Went to sleep, moves up a level when it wakes up
+    unsigned int t_runticks; // Ticks charged while running
+    unsigned int t_waitticks; // Ticks spent runnable on a run queue
+    unsigned int t_readyat; // Scheduler tick count when it last became runnable
+    unsigned int t_nvcsw; // Switches away because it slept or yielded
+    unsigned int t_nivcsw; // Switches away because it was preempted
     char *t_stack;
 
     /**********************************************************/
@@ -93,12 +103,49 @@ void thread_sleep(const void *addr);
  */
 void thread_wakeup(const void *addr);
 
+/*
+ * Wake up only the thread that has been sleeping longest on the
+ * specified address. Returns nonzero if there was one.
+ * Interrupts must be disabled.
+ */
+int thread_wakeone(const void *addr);
+
 /*
  * Return nonzero if there are any threads sleeping on the specified
  * address. Meant only for diagnostic purposes.
  */
 int thread_hassleepers(const void *addr);
 
+/* Number of context switches to a different thread since boot. */
+unsigned int thread_switch_count(void);
+
+/*
+ * Wait channel, a FIFO queue of sleeping threads linked through the
+ * threads themselves, so sleeping never allocates. Synchronization
+ * primitives keep one of their own. thread_sleep and thread_wakeup on a
+ * bare address use a table of them hashed by the address, and only look
+ * at the threads that hashed to the same channel.
+ *
+ *    wchan_init    - set up an empty channel.
+ *    wchan_sleep   - sleep on the channel until woken up.
+ *    wchan_wakeall - make every thread on the channel runnable.
+ *    wchan_wakeone - make the thread that has been on the channel longest
+ *                    runnable and hand it back, NULL if there is none.
+ *    wchan_isempty - return nonzero if nobody sleeps on the channel.
+ *
+ * Interrupts must be disabled for all of them.
+ */
+struct wchan {
+    struct thread *wc_head;
+    struct thread *wc_tail;
+};
+
+void wchan_init(struct wchan *wc);
+void wchan_sleep(struct wchan *wc);
+void wchan_wakeall(struct wchan *wc);
+struct thread *wchan_wakeone(struct wchan *wc);
+int  wchan_isempty(struct wchan *wc);
+
 
 /*
  * Private thread functions.
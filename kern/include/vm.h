@@ -9,8 +9,6 @@
 #define VM_FAULT_WRITE       1    /* A write was attempted */
 #define VM_FAULT_READONLY    2    /* A write to a readonly page was attempted*/
 
-extern struct lock *vm_fault_lock;
-
 /* Initialization function */
 void vm_bootstrap(void);
 
@@ -20,6 +18,25 @@ paddr_t getppages(unsigned long npages);
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
+/* Menu command printing TLB refill and miss counts, optionally setting the fault block size */
+int vm_stats(int nargs, char **arg);
+
+/*
+ * Shared file mappings (vm.c):
+ *
+ *    vm_write_file_page - write a page of a shared mapping back to its
+ *                file, only the part below end of file. Interrupts are
+ *                on during the I/O, the caller keeps the page busy.
+ *
+ *    vm_sync_segment - write back every page of a shared mapping that was
+ *                written to since it was last written back. The caller
+ *                holds the address space lock.
+ */
+struct vnode;
+struct as_segment;
+int vm_write_file_page(struct vnode *v, off_t offset, paddr_t paddr);
+int vm_sync_segment(struct addrspace *as, struct as_segment *seg);
+
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
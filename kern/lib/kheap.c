@@ -45,6 +45,13 @@ fill_deadbeef(void *vptr, size_t len)
 #undef  SLOW	/* consistency checks */
 #undef SLOWER	/* lots of consistency checks */
 
+//
+// Without SLOW/SLOWER, the same checks (and poisoning freed blocks
+// with 0xdeadbeef) can be switched on at runtime by setting DB_KMALLOC
+// in dbflags ("df 12 on" from the menu). With DB_KMALLOC off, kmalloc
+// and kfree touch only the page they are working on.
+//
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
@@ -161,7 +168,17 @@ static struct pageref *allbase;
 #endif
 #endif
 
-#ifdef SLOW
+#ifdef SLOWER
+#define KHEAP_CHECK      1
+#define KHEAP_CHECK_ALL  1
+#elif defined(SLOW)
+#define KHEAP_CHECK      1
+#define KHEAP_CHECK_ALL  (dbflags & DB_KMALLOC)
+#else
+#define KHEAP_CHECK      (dbflags & DB_KMALLOC)
+#define KHEAP_CHECK_ALL  (dbflags & DB_KMALLOC)
+#endif
+
 static
 void
 checksubpage(struct pageref *pr)
@@ -171,6 +188,10 @@ checksubpage(struct pageref *pr)
 	int blktype;
 	int nfree=0;
 
+	if (!KHEAP_CHECK) {
+		return;
+	}
+
 	assert(curspl>0);
 
 	if (pr->freelist_offset == INVALID_OFFSET) {
@@ -197,11 +218,7 @@ checksubpage(struct pageref *pr)
 	}
 	assert(nfree==pr->nfree);
 }
-#else
-#define checksubpage(pr) ((void)(pr))
-#endif
 
-#ifdef SLOWER
 static
 void
 checksubpages(void)
@@ -210,6 +227,10 @@ checksubpages(void)
 	int i;
 	unsigned sc=0, ac=0;
 
+	if (!KHEAP_CHECK_ALL) {
+		return;
+	}
+
 	assert(curspl>0);
 
 	for (i=0; i<NSIZES; i++) {
@@ -228,9 +249,6 @@ checksubpages(void)
 
 	assert(sc==ac);
 }
-#else
-#define checksubpages() 
-#endif
 
 ////////////////////////////////////////
 
@@ -285,6 +303,8 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+static void kmem_cache_printstats(void);
+
 void
 kheap_printstats(void)
 {
@@ -299,6 +319,8 @@ kheap_printstats(void)
 		dumpsubpage(pr);
 	}
 
+	kmem_cache_printstats();
+
 	splx(spl);
 }
 
@@ -508,7 +530,9 @@ subpage_kfree(void *ptr)
 	 * Clear the block to 0xdeadbeef to make it easier to detect
 	 * uses of dangling pointers.
 	 */
-	fill_deadbeef(ptr, sizes[blktype]);
+	if (KHEAP_CHECK) {
+		fill_deadbeef(ptr, sizes[blktype]);
+	}
 
 	/*
 	 * We probably ought to check for free twice by seeing if the block
@@ -542,6 +566,334 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////
+//
+// Object caches.
+//
+// Each cache hands out objects of one size from pages of its own
+// (slabs). The slab header sits at the start of its page, so the slab
+// of an object is found by masking the address, and every slab keeps
+// its own free list. Slabs with free objects are kept on a list in
+// the cache, full slabs aren't on any list. Thus alloc and free are
+// O(1); a new slab costs one alloc_kpages.
+//
+// Objects are constructed when their slab is created, and keep their
+// constructed state while they sit on the free list, so a constructor
+// with expensive setup runs only once per object rather than once per
+// allocation. The destructor runs when a slab is given back.
+//
+// One completely free slab is kept per cache so that a workload
+// allocating and freeing a single object doesn't bounce a page in and
+// out of the cache. Further empty slabs are released.
+//
+
+#define SLAB_MAGIC 0x51ab51ab
+
+struct slab {
+	u_int32_t s_magic;
+	struct kmem_cache *s_cache;
+	struct slab *s_next;		// on kc_partial
+	struct slab *s_prev;
+	void *s_free;			// first free object in this slab
+	unsigned s_inuse;
+};
+
+/* Objects start after the header, aligned the way kmalloc aligns. */
+#define SLAB_HEADER_SIZE ((sizeof(struct slab) + 7) & ~(size_t)7)
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			// object size, rounded up
+	size_t kc_stride;		// distance between objects
+	size_t kc_link;			// offset of the free list link
+	unsigned kc_perslab;		// objects per slab
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+	struct slab *kc_partial;	// slabs with free objects
+	struct slab *kc_empty;		// one completely free slab, or NULL
+	unsigned kc_nslabs;
+	unsigned kc_inuse;
+	struct kmem_cache *kc_next;	// on all_caches
+};
+
+static struct kmem_cache *all_caches;
+
+#define SLAB_OF(obj) ((struct slab *)((vaddr_t)(obj) & PAGE_FRAME))
+#define SLAB_OBJ(sl, i) \
+	((void *)((vaddr_t)(sl) + SLAB_HEADER_SIZE + (i)*(sl)->s_cache->kc_stride))
+#define SLAB_LINK(c, obj) (*(void **)((vaddr_t)(obj) + (c)->kc_link))
+
+/*
+ * Debug validation: make sure OBJ is an object of SL, and, when
+ * FREEING, that it isn't on the free list already.
+ */
+static
+void
+checkslabobj(struct slab *sl, void *obj, int freeing)
+{
+	struct kmem_cache *c = sl->s_cache;
+	void *fl;
+	vaddr_t offset;
+	unsigned nfree = 0;
+
+	if (!KHEAP_CHECK) {
+		return;
+	}
+
+	assert(sl->s_magic == SLAB_MAGIC);
+	offset = (vaddr_t)obj - (vaddr_t)sl;
+	if (offset < SLAB_HEADER_SIZE ||
+	    (offset - SLAB_HEADER_SIZE) % c->kc_stride != 0 ||
+	    (offset - SLAB_HEADER_SIZE) / c->kc_stride >= c->kc_perslab) {
+		panic("kmem_cache %s: bad object %p\n", c->kc_name, obj);
+	}
+	for (fl = sl->s_free; fl != NULL; fl = SLAB_LINK(c, fl)) {
+		if (freeing && fl == obj) {
+			panic("kmem_cache %s: double free of %p\n",
+			      c->kc_name, obj);
+		}
+		assert(SLAB_OF(fl) == sl);
+		nfree++;
+	}
+	assert(nfree + sl->s_inuse == c->kc_perslab);
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *), void (*dtor)(void *))
+{
+	struct kmem_cache *c;
+	int spl;
+
+	/* Same rules as subpage blocks: room for the free list link, 8-aligned. */
+	if (size < sizeof(void *)) {
+		size = sizeof(void *);
+	}
+	size = (size + 7) & ~(size_t)7;
+
+	c = kmalloc(sizeof(struct kmem_cache));
+	if (c == NULL) {
+		return NULL;
+	}
+	c->kc_name = name;
+	c->kc_size = size;
+	/*
+	 * A free object normally holds its link in its first word.
+	 * Constructed objects have to stay intact while free, so theirs
+	 * goes after the object instead.
+	 */
+	if (ctor != NULL) {
+		c->kc_link = size;
+		c->kc_stride = size + 8;
+	}
+	else {
+		c->kc_link = 0;
+		c->kc_stride = size;
+	}
+	if (c->kc_stride > PAGE_SIZE - SLAB_HEADER_SIZE) {
+		panic("kmem_cache_create: %s objects too big for a slab\n",
+		      name);
+	}
+	c->kc_perslab = (PAGE_SIZE - SLAB_HEADER_SIZE) / c->kc_stride;
+	c->kc_ctor = ctor;
+	c->kc_dtor = dtor;
+	c->kc_partial = NULL;
+	c->kc_empty = NULL;
+	c->kc_nslabs = 0;
+	c->kc_inuse = 0;
+
+	spl = splhigh();
+	c->kc_next = all_caches;
+	all_caches = c;
+	splx(spl);
+
+	return c;
+}
+
+static
+void
+slab_link(struct kmem_cache *c, struct slab *sl)
+{
+	sl->s_prev = NULL;
+	sl->s_next = c->kc_partial;
+	if (c->kc_partial != NULL) {
+		c->kc_partial->s_prev = sl;
+	}
+	c->kc_partial = sl;
+}
+
+static
+void
+slab_unlink(struct kmem_cache *c, struct slab *sl)
+{
+	if (sl->s_prev != NULL) {
+		sl->s_prev->s_next = sl->s_next;
+	}
+	else {
+		assert(c->kc_partial == sl);
+		c->kc_partial = sl->s_next;
+	}
+	if (sl->s_next != NULL) {
+		sl->s_next->s_prev = sl->s_prev;
+	}
+	sl->s_next = sl->s_prev = NULL;
+}
+
+/*
+ * Run the destructor on the first N objects of a slab and give the
+ * page back.
+ */
+static
+void
+slab_release(struct kmem_cache *c, struct slab *sl, unsigned n)
+{
+	unsigned i;
+
+	assert(sl->s_inuse == 0);
+	if (c->kc_dtor != NULL) {
+		for (i=0; i<n; i++) {
+			c->kc_dtor(SLAB_OBJ(sl, i));
+		}
+	}
+	sl->s_magic = 0;
+	free_kpages((vaddr_t)sl);
+}
+
+static
+struct slab *
+slab_create(struct kmem_cache *c)
+{
+	struct slab *sl;
+	unsigned i;
+
+	sl = (struct slab *)alloc_kpages(1);
+	if (sl == NULL) {
+		return NULL;
+	}
+	sl->s_magic = SLAB_MAGIC;
+	sl->s_cache = c;
+	sl->s_next = sl->s_prev = NULL;
+	sl->s_free = NULL;
+	sl->s_inuse = 0;
+
+	if (c->kc_ctor != NULL) {
+		for (i=0; i<c->kc_perslab; i++) {
+			if (c->kc_ctor(SLAB_OBJ(sl, i))) {
+				/* Undo the ones we already constructed. */
+				slab_release(c, sl, i);
+				return NULL;
+			}
+		}
+	}
+
+	/* Thread the free list backwards so objects go out in address order. */
+	for (i=c->kc_perslab; i>0; i--) {
+		SLAB_LINK(c, SLAB_OBJ(sl, i-1)) = sl->s_free;
+		sl->s_free = SLAB_OBJ(sl, i-1);
+	}
+
+	c->kc_nslabs++;
+	return sl;
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+	struct slab *sl;
+	void *obj;
+	int spl;
+
+	spl = splhigh();
+
+	sl = c->kc_partial;
+	if (sl == NULL) {
+		if (c->kc_empty != NULL) {
+			sl = c->kc_empty;
+			c->kc_empty = NULL;
+		}
+		else {
+			sl = slab_create(c);
+			if (sl == NULL) {
+				splx(spl);
+				return NULL;
+			}
+		}
+		slab_link(c, sl);
+	}
+
+	obj = sl->s_free;
+	assert(obj != NULL);
+	checkslabobj(sl, obj, 0);
+	sl->s_free = SLAB_LINK(c, obj);
+	sl->s_inuse++;
+	c->kc_inuse++;
+	if (sl->s_free == NULL) {
+		/* Full now, it goes back on the list with its next free. */
+		slab_unlink(c, sl);
+	}
+
+	splx(spl);
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+	struct slab *sl;
+	int spl;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	sl = SLAB_OF(obj);
+	assert(sl->s_cache == c);
+
+	spl = splhigh();
+
+	checkslabobj(sl, obj, 1);
+
+	if (sl->s_free == NULL) {
+		/* Was full. */
+		slab_link(c, sl);
+	}
+	SLAB_LINK(c, obj) = sl->s_free;
+	sl->s_free = obj;
+	assert(sl->s_inuse > 0);
+	sl->s_inuse--;
+	c->kc_inuse--;
+
+	if (sl->s_inuse == 0) {
+		slab_unlink(c, sl);
+		if (c->kc_empty == NULL) {
+			c->kc_empty = sl;
+		}
+		else {
+			c->kc_nslabs--;
+			slab_release(c, sl, c->kc_perslab);
+		}
+	}
+
+	splx(spl);
+}
+
+static
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *c;
+
+	kprintf("Object caches:\n");
+	for (c = all_caches; c != NULL; c = c->kc_next) {
+		kprintf("  %-16s size %-4lu  %u objects in use, %u slabs (%u per slab)\n",
+			c->kc_name, (unsigned long)c->kc_size, c->kc_inuse,
+			c->kc_nslabs, c->kc_perslab);
+	}
+}
+
+//
+////////////////////////////////////////////////////////////
+
 void *
 kmalloc(size_t sz)
 {
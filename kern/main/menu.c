@@ -9,8 +9,11 @@
 #include <lib.h>
 #include <clock.h>
 #include <coremap.h>
+#include <vm.h>
+#include <pageout.h>
 #include <thread.h>
 #include <process.h>
+#include <scheduler.h>
 #include <syscall.h>
 #include <uio.h>
 #include <vfs.h>
@@ -387,6 +390,30 @@ cmd_kheapstats(int nargs, char **args)
     return 0;
 }
 
+/*
+ * Command for dumping the run queues of the scheduler, and optionally
+ * setting the quantum in ticks.
+ */
+static
+int
+cmd_runqueue(int nargs, char **args)
+{
+    if (nargs == 2) {
+        int result = scheduler_set_quantum(atoi(args[1]));
+        if (result) {
+            kprintf("rq: quantum must be 1 to %d ticks\n", HZ);
+            return result;
+        }
+    } else if (nargs != 1) {
+        kprintf("Usage: rq [quantum]\n");
+        return EINVAL;
+    }
+
+    print_run_queue();
+
+    return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -477,6 +504,7 @@ static const char *testmenu[] = {
     "[qt]  Queue test                    ",
     "[km1] Kernel malloc test            ",
     "[km2] kmalloc stress test           ",
+    "[km3] kmalloc benchmark             ",
     "[tt1] Thread test 1                 ",
     "[tt2] Thread test 2                 ",
     "[tt3] Thread test 3                 ",
@@ -486,6 +514,7 @@ static const char *testmenu[] = {
     "[sy1] Semaphore test                ",
     "[sy2] Lock test             (1)     ",
     "[sy3] CV test               (1)     ",
+    "[sy4] Lock contention benchmark     ",
     "[fs1] Filesystem test               ",
     "[fs2] FS read stress        (4)     ",
     "[fs3] FS write stress       (4)     ",
@@ -521,6 +550,10 @@ static const char *mainmenu[] = {
 #endif
     "[kh] Kernel heap stats              ",
     "[cm] Coremap stats                  ",
+    "[pd] Pageout daemon stats           ",
+    "[vs] VM fault stats                 ",
+    "[rq] Scheduler run queues           ",
+    "[ss] Scheduler stats                ",
     "[q] Quit and shut down              ",
     NULL
 };
@@ -580,7 +613,11 @@ static struct {
     /* stats */
     { "kh",         cmd_kheapstats },
     { "cm",         coremap_stats },
+    { "pd",         pageout_stats },
+    { "vs",         vm_stats },
     { "ps",         process_stats },
+    { "rq",         cmd_runqueue },
+    { "ss",         scheduler_stats },
 
     /* base system tests */
     { "at",     arraytest },
@@ -588,6 +625,7 @@ static struct {
     { "qt",     queuetest },
     { "km1",    malloctest },
     { "km2",    mallocstress },
+    { "km3",    mallocbench },
 #if OPT_NET
     { "net",    nettest },
 #endif
@@ -599,6 +637,7 @@ static struct {
     /* synchronization assignment tests */
     { "sy2",    locktest },
     { "sy3",    cvtest },
+    { "sy4",    lockbench },
 
     /* file system assignment tests */
     { "fs1",    fstest },
@@ -2,9 +2,11 @@
  * Test code for kmalloc.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <synch.h>
 #include <thread.h>
+#include <clock.h>
 #include <test.h>
 
 /*
@@ -108,3 +110,96 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Allocator microbenchmark. Keep KM3_LIVE small blocks allocated so
+ * the heap has something in it, then time KM3_ROUNDS rounds of
+ * allocating and freeing one block of each of a spread of sizes. Runs
+ * once with the kheap consistency checks off and once with them on
+ * (DB_KMALLOC), and reports allocations per second for each.
+ */
+
+#define KM3_LIVE    256
+#define KM3_ROUNDS  200
+#define KM3_NSIZES  6
+
+static const size_t km3sizes[KM3_NSIZES] = { 16, 40, 100, 200, 500, 1000 };
+
+static
+int
+km3run(void **live, const char *mode)
+{
+	time_t s1, s2, secs;
+	u_int32_t ns1, ns2, nsecs, ms;
+	void *ptrs[KM3_NSIZES];
+	int i, j;
+
+	for (i=0; i<KM3_LIVE; i++) {
+		live[i] = kmalloc(km3sizes[i % KM3_NSIZES]);
+		if (live[i]==NULL) {
+			kprintf("km3: kmalloc returned NULL\n");
+			while (--i >= 0) {
+				kfree(live[i]);
+			}
+			return ENOMEM;
+		}
+	}
+
+	gettime(&s1, &ns1);
+	for (i=0; i<KM3_ROUNDS; i++) {
+		for (j=0; j<KM3_NSIZES; j++) {
+			ptrs[j] = kmalloc(km3sizes[j]);
+			if (ptrs[j]==NULL) {
+				panic("km3: kmalloc returned NULL\n");
+			}
+		}
+		for (j=0; j<KM3_NSIZES; j++) {
+			kfree(ptrs[j]);
+		}
+	}
+	gettime(&s2, &ns2);
+
+	for (i=0; i<KM3_LIVE; i++) {
+		kfree(live[i]);
+	}
+
+	getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+	ms = secs*1000 + nsecs/1000000;
+	if (ms == 0) {
+		ms = 1;
+	}
+	kprintf("km3: %s: %d allocs in %lu.%09lu s, %u allocs/sec\n",
+		mode, KM3_ROUNDS*KM3_NSIZES, (unsigned long) secs,
+		(unsigned long) nsecs, KM3_ROUNDS*KM3_NSIZES*1000 / ms);
+	return 0;
+}
+
+int
+mallocbench(int nargs, char **args)
+{
+	u_int32_t saved = dbflags;
+	void **live;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	live = kmalloc(KM3_LIVE * sizeof(void *));
+	if (live==NULL) {
+		return ENOMEM;
+	}
+
+	kprintf("Starting kmalloc benchmark...\n");
+
+	dbflags &= ~DB_KMALLOC;
+	result = km3run(live, "production");
+	if (result == 0) {
+		dbflags |= DB_KMALLOC;
+		result = km3run(live, "debug");
+	}
+	dbflags = saved;
+
+	kfree(live);
+	kprintf("kmalloc benchmark done\n");
+	return result;
+}
@@ -13,6 +13,8 @@
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
 #define NTHREADS      32
+#define NBENCHLOOPS   200
+#define NBENCHTHREADS 8
 
 static volatile unsigned long testval1;
 static volatile unsigned long testval2;
@@ -273,3 +275,72 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Lock contention benchmark. Every thread yields while holding the
+ * lock, so all the others are queued on it by the time it is released
+ * and every acquisition but the first is a handoff. With wake-one
+ * handoff that should cost a small constant number of context switches
+ * each, no matter how many threads are waiting.
+ */
+static
+void
+lockbenchthread(void *junk, unsigned long num)
+{
+	int i;
+	(void)junk;
+
+	for (i=0; i<NBENCHLOOPS; i++) {
+		lock_acquire(testlock);
+		testval1 = num;
+		thread_yield();
+		if (testval1 != num) {
+			fail(num, "testval1/num");
+		}
+		lock_release(testlock);
+	}
+	V(donesem);
+}
+
+int
+lockbench(int nargs, char **args)
+{
+	int i, result;
+	unsigned int switches, handoffs;
+	time_t s1, s2, secs;
+	u_int32_t ns1, ns2, nsecs;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting lock contention benchmark...\n");
+
+	switches = thread_switch_count();
+	gettime(&s1, &ns1);
+	for (i=0; i<NBENCHTHREADS; i++) {
+		result = thread_fork("lockbench", NULL, i, lockbenchthread,
+				     NULL);
+		if (result) {
+			panic("lockbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NBENCHTHREADS; i++) {
+		P(donesem);
+	}
+	gettime(&s2, &ns2);
+	switches = thread_switch_count() - switches;
+
+	getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+	handoffs = NBENCHTHREADS*NBENCHLOOPS;
+	kprintf("lockbench: %u handoffs among %d threads in %lu.%09lu s\n",
+		handoffs, NBENCHTHREADS, (unsigned long) secs,
+		(unsigned long) nsecs);
+	kprintf("lockbench: %u context switches, %u.%02u per handoff\n",
+		switches, switches / handoffs,
+		(switches % handoffs) * 100 / handoffs);
+	kprintf("Lock contention benchmark done.\n");
+
+	return 0;
+}
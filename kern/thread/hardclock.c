@@ -2,6 +2,7 @@
 #include <lib.h>
 #include <machine/spl.h>
 #include <thread.h>
+#include <scheduler.h>
 #include <clock.h>
 
 /* 
@@ -11,25 +12,123 @@ int lbolt;
 
 static int lbolt_counter;
 
+/* Nanoseconds per tick. */
+#define TICK_NSECS (1000000000 / HZ)
+
+/*
+ * Tickless idle state. While idle, idle_secs/idle_nsecs is the time up
+ * to which ticks have been accounted for.
+ */
+static int idle;
+static time_t idle_secs;
+static u_int32_t idle_nsecs;
+
+/*
+ * Count the ticks that went by since the idle time base, and move the
+ * base forward by that many whole ticks.
+ */
+static
+int
+hardclock_idle_ticks(void)
+{
+	time_t now_secs, secs;
+	u_int32_t now_nsecs, nsecs;
+	int ticks;
+
+	gettime(&now_secs, &now_nsecs);
+	getinterval(idle_secs, idle_nsecs, now_secs, now_nsecs, &secs, &nsecs);
+	ticks = secs*HZ + nsecs/TICK_NSECS;
+
+	idle_secs += ticks / HZ;
+	idle_nsecs += (ticks % HZ) * TICK_NSECS;
+	if (idle_nsecs >= 1000000000) {
+		idle_nsecs -= 1000000000;
+		idle_secs++;
+	}
+	return ticks;
+}
+
 /*
- * This is called HZ times a second by the timer device setup.
+ * Account TICKS ticks, waking up lbolt sleepers if a second went by.
+ */
+static
+void
+hardclock_advance(int ticks)
+{
+	lbolt_counter += ticks;
+	if (lbolt_counter >= HZ) {
+		lbolt_counter %= HZ;
+		thread_wakeup(&lbolt);
+	}
+}
+
+/*
+ * This is called HZ times a second by the timer device setup, or at
+ * the next deadline while the CPU is idle.
  */
 
 void
 hardclock(void)
 {
+	int ticks = 1;
+
 	/*
 	 * Collect statistics here as desired.
 	 */
 
+	if (idle) {
+		ticks = hardclock_idle_ticks();
+	}
 
-	lbolt_counter++;
-	if (lbolt_counter >= HZ) {
-		lbolt_counter = 0;
-		thread_wakeup(&lbolt);
+	hardclock_advance(ticks);
+
+	/* Only switch when the quantum is up or a more important thread waits. */
+	if (scheduler_tick(ticks)) {
+		thread_yield();
+	}
+}
+
+/*
+ * Nothing to run. Program the timer for the next time something has
+ * to happen instead of taking an interrupt every tick: the next lbolt
+ * if anybody sleeps on it, and at most a second from now otherwise.
+ */
+void
+hardclock_idle(void)
+{
+	int ticks = HZ;
+
+	assert(curspl>0);
+
+	if (!idle) {
+		idle = 1;
+		gettime(&idle_secs, &idle_nsecs);
+	}
+	if (thread_hassleepers(&lbolt)) {
+		ticks = HZ - lbolt_counter;
 	}
+	hardclock_setinterval(ticks);
+}
 
-	thread_yield();
+/*
+ * Something is runnable again, catch up on the ticks we skipped and
+ * go back to ticking HZ times a second.
+ */
+void
+hardclock_resume(void)
+{
+	int ticks;
+
+	assert(curspl>0);
+
+	if (!idle) {
+		return;
+	}
+	ticks = hardclock_idle_ticks();
+	hardclock_advance(ticks);
+	scheduler_tick(ticks); /* Idle ticks, nobody to preempt */
+	idle = 0;
+	hardclock_setinterval(1);
 }
 
 /*
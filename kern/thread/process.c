@@ -6,8 +6,11 @@
 #include <machine/spl.h>
 #include <machine/trapframe.h>
 #include <addrspace.h>
+#include <coremap.h>
 #include <vfs.h>
+#include <vnode.h>
 #include <process.h>
+#include <clock.h>
 
 #define PREALLOCATE_PROCESS 32
 
@@ -19,6 +22,29 @@ static pid_t pid_counter = 1;
 /* An array of processes*/
 static struct array *process_table;
 
+/* Process structures, each one keeps its exit semaphore while it sits in the cache */
+static struct kmem_cache *process_cache;
+
+static
+int
+process_ctor(void *obj)
+{
+    struct process *process = obj;
+    process->sem_exit = sem_create("sem_exit", 0);
+    if (process->sem_exit == NULL) {
+        return ENOMEM;
+    }
+    return 0;
+}
+
+static
+void
+process_dtor(void *obj)
+{
+    struct process *process = obj;
+    sem_destroy(process->sem_exit);
+}
+
 static
 pid_t
 allocate_pid(void)
@@ -33,6 +59,11 @@ allocate_pid(void)
 void
 process_bootstrap(void)
 {
+    process_cache = kmem_cache_create("process", sizeof(struct process), process_ctor, process_dtor);
+    if (process_cache == NULL) {
+        panic("Cannot create process cache\n");
+    }
+
     process_table = array_create();
     array_preallocate(process_table, PREALLOCATE_PROCESS);
     if (process_table == NULL) {
@@ -40,26 +71,118 @@ process_bootstrap(void)
     }
 }
 
+// With a pid and a page count this sets the resident set limit of the process, 0 removes it
 int
 process_stats(int nargs, char **arg)
 {
-    // Unused parameters
-    (void)nargs;
-    (void)arg;
     int spl = splhigh(); // Disable interrupt when printing
+    int i;
+
+    if (nargs == 3) {
+        pid_t pid = atoi(arg[1]);
+        struct addrspace *as = NULL;
+        for (i = 0; i < array_getnum(process_table); i++) {
+            struct process *p = array_getguy(process_table, i);
+            if (p != NULL && p->pid == pid && !p->exited_flag) {
+                as = p->p_thread->t_vmspace;
+            }
+        }
+        if (as == NULL) {
+            splx(spl);
+            kprintf("ps: no running process with pid %d\n", pid);
+            return EINVAL;
+        }
+        as->as_rss_limit = atoi(arg[2]);
+    } else if (nargs != 1) {
+        splx(spl);
+        kprintf("Usage: ps [pid rsslimit]\n");
+        return EINVAL;
+    }
 
     kprintf("Printing process table entries\n");
-    int i;
     for (i = 0; i < array_getnum(process_table); i++) {
         struct process *p = array_getguy(process_table, i);
         if (p != NULL) {
-            kprintf("Process pid:%d, ppid:%d, exited:%d, adopted:%d\n", p->pid, p->ppid, p->exited_flag, p->adopted_flag);
+            kprintf("Process pid:%d, ppid:%d, exited:%d, adopted:%d", p->pid, p->ppid, p->exited_flag, p->adopted_flag);
+            struct addrspace *as = p->exited_flag ? NULL : p->p_thread->t_vmspace;
+            if (as != NULL) {
+                kprintf(", rss:%u, ws:%u, swapped:%u, faults:%u(%u major)",
+                        as->as_rss, coremap_as_ws(as), as_swapped_pages(as), as->as_faults, as->as_major_faults);
+                if (as->as_rss_limit > 0) {
+                    kprintf(", limit:%u", as->as_rss_limit);
+                }
+            }
+            kprintf("\n");
+        }
+    }
+    splx(spl);
+    return 0;
+}
+
+// Ticks to milliseconds without overflowing on long runtimes
+#define TICKS_TO_MS(ticks) (((ticks) / HZ) * 1000 + ((ticks) % HZ) * 1000 / HZ)
+
+static
+void
+process_rusage_add(struct rusage *total, const struct rusage *ru)
+{
+    total->ru_cputime += ru->ru_cputime;
+    total->ru_waittime += ru->ru_waittime;
+    total->ru_nvcsw += ru->ru_nvcsw;
+    total->ru_nivcsw += ru->ru_nivcsw;
+    total->ru_minflt += ru->ru_minflt;
+    total->ru_majflt += ru->ru_majflt;
+}
+
+int
+process_getrusage(int who, struct rusage *ru)
+{
+    int spl = splhigh();
+    if (who == RUSAGE_CHILDREN) {
+        *ru = curthread->p_process->p_cru;
+    } else if (who == RUSAGE_SELF) {
+        ru->ru_cputime = TICKS_TO_MS(curthread->t_runticks);
+        ru->ru_waittime = TICKS_TO_MS(curthread->t_waitticks);
+        ru->ru_nvcsw = curthread->t_nvcsw;
+        ru->ru_nivcsw = curthread->t_nivcsw;
+        ru->ru_minflt = 0;
+        ru->ru_majflt = 0;
+        struct addrspace *as = curthread->t_vmspace;
+        if (as != NULL) {
+            ru->ru_minflt = as->as_faults - as->as_major_faults;
+            ru->ru_majflt = as->as_major_faults;
         }
+    } else {
+        splx(spl);
+        return EINVAL;
     }
     splx(spl);
     return 0;
 }
 
+void
+process_cpu_stats(void)
+{
+    int spl = splhigh();
+    kprintf("  pid name             cpu ms   wait ms  voluntary  preempted\n");
+    int i;
+    for (i = 0; i < array_getnum(process_table); i++) {
+        struct process *p = array_getguy(process_table, i);
+        if (p == NULL) {
+            continue;
+        }
+        if (p->exited_flag) { // The thread may be gone, use what was saved at exit
+            kprintf("%5d %-14s %8lu %9lu %10lu %10lu\n", p->pid, "(exited)",
+                    p->p_ru.ru_cputime, p->p_ru.ru_waittime, p->p_ru.ru_nvcsw, p->p_ru.ru_nivcsw);
+            continue;
+        }
+        struct thread *t = p->p_thread;
+        kprintf("%5d %-14s %8u %9u %10u %10u\n", p->pid, t->t_name,
+                TICKS_TO_MS(t->t_runticks), TICKS_TO_MS(t->t_waitticks), t->t_nvcsw, t->t_nivcsw);
+    }
+    splx(spl);
+}
+
 struct process *
 process_create(struct thread * thread)
 {
@@ -70,7 +193,7 @@ process_create(struct thread * thread)
         return NULL;
     }
 
-    struct process *process = kmalloc(sizeof(struct process));
+    struct process *process = kmem_cache_alloc(process_cache);
     if (process == NULL) {
         splx(spl);
         return NULL;
@@ -88,17 +211,27 @@ process_create(struct thread * thread)
     process->exited_flag = 0;
     process->exit_code = -1;
     process->p_thread = thread;
-    struct semaphore *sem = sem_create("sem_exit", 0);
-    if (sem == NULL) {
-        kfree(process);
-        splx(spl);
-        return NULL;
+    // The exit semaphore comes with the cached structure, a previous user that was never waited for left it at 1
+    process->sem_exit->count = 0;
+    bzero(&process->p_cru, sizeof(struct rusage));
+
+    // A forked child inherits the parent's open files, it closes its copies with vfs_close like its own
+    int fd;
+    for (fd = 0; fd < OPEN_MAX; fd++) {
+        process->p_files[fd] = NULL;
+        process->p_fmodes[fd] = 0;
+        process->p_offsets[fd] = 0;
+        if (new_pid != 1 && curthread->p_process->p_files[fd] != NULL) {
+            process->p_files[fd] = curthread->p_process->p_files[fd];
+            process->p_fmodes[fd] = curthread->p_process->p_fmodes[fd];
+            process->p_offsets[fd] = curthread->p_process->p_offsets[fd];
+            VOP_INCOPEN(process->p_files[fd]);
+            VOP_INCREF(process->p_files[fd]);
+        }
     }
-    process->sem_exit = sem;
 
     if (array_add(process_table, process)) {
-        kfree(process);
-        kfree(sem);
+        kmem_cache_free(process_cache, process);
         splx(spl);
         return NULL;
     }
@@ -124,6 +257,9 @@ process_exit(int exit_code)
         }
     }
 
+    // The address space goes away with the thread, keep what the parent can ask for
+    process_getrusage(RUSAGE_SELF, &curthread->p_process->p_ru);
+
     V(curthread->p_process->sem_exit); // Now signal processes which are waiting
 
     // Now exit the thread
@@ -136,8 +272,8 @@ process_destroy(struct process *process)
     assert(curspl>0); // Interrupt should be off here
     assert(process != curthread->p_process);
     pid_t pid = process->pid;
-    sem_destroy(process->sem_exit);
-    kfree(process);
+    assert(wchan_isempty(&process->sem_exit->wchan));
+    kmem_cache_free(process_cache, process);
     array_setguy(process_table, pid - 1, NULL);
 }
 
@@ -146,7 +282,7 @@ process_shutdown(void)
 {
     int i;
     for (i = 0; i < array_getnum(process_table); i++) {
-        kfree(array_getguy(process_table, i));
+        kmem_cache_free(process_cache, array_getguy(process_table, i));
     }
     array_destroy(process_table);
     process_table = NULL;
@@ -212,6 +348,10 @@ process_wait(pid_t pid, int *status)
         return_val = process->exit_code;
     }
 
+    // The child's usage and what it collected from its own children go to us
+    process_rusage_add(&curthread->p_process->p_cru, &process->p_ru);
+    process_rusage_add(&curthread->p_process->p_cru, &process->p_cru);
+
     // Reap the child process
     int i;
     for (i=0; i<array_getnum(zombies); i++) {
@@ -330,3 +470,99 @@ process_execv(const char *program, unsigned long argc, char **argv)
     panic("md_usermode returned\n");
     return EINVAL;
 }
+
+int
+process_open(char *path, int flags, int *fd)
+{
+    struct process *process = curthread->p_process;
+    int i;
+    for (i = STDERR_FILENO + 1; i < OPEN_MAX; i++) {
+        if (process->p_files[i] == NULL) {
+            break;
+        }
+    }
+    if (i == OPEN_MAX) {
+        return EMFILE;
+    }
+
+    struct vnode *v;
+    int err = vfs_open(path, flags, &v);
+    if (err) {
+        return err;
+    }
+    // vfs_open can sleep, but only this process hands out its handles
+    assert(process->p_files[i] == NULL);
+    process->p_files[i] = v;
+    process->p_fmodes[i] = flags & O_ACCMODE;
+    process->p_offsets[i] = 0;
+    *fd = i;
+    return 0;
+}
+
+int
+process_close(int fd)
+{
+    struct process *process = curthread->p_process;
+    if (fd < 0 || fd >= OPEN_MAX || process->p_files[fd] == NULL) {
+        return EBADF;
+    }
+    struct vnode *v = process->p_files[fd];
+    process->p_files[fd] = NULL;
+    vfs_close(v);
+    return 0;
+}
+
+struct vnode *
+process_file(int fd, int *mode)
+{
+    struct process *process = curthread->p_process;
+    if (fd < 0 || fd >= OPEN_MAX || process->p_files[fd] == NULL) {
+        return NULL;
+    }
+    *mode = process->p_fmodes[fd];
+    return process->p_files[fd];
+}
+
+int
+process_file_io(int fd, userptr_t buf, size_t len, enum uio_rw rw, int *retval)
+{
+    struct process *process = curthread->p_process;
+    if (fd < 0 || fd >= OPEN_MAX || process->p_files[fd] == NULL) {
+        return EBADF;
+    }
+    int mode = process->p_fmodes[fd];
+    if ((rw == UIO_READ && mode == O_WRONLY) || (rw == UIO_WRITE && mode == O_RDONLY)) {
+        return EBADF;
+    }
+
+    struct uio u;
+    u.uio_iovec.iov_ubase = buf;
+    u.uio_iovec.iov_len = len;
+    u.uio_resid = len;
+    u.uio_offset = process->p_offsets[fd];
+    u.uio_segflg = UIO_USERSPACE;
+    u.uio_rw = rw;
+    u.uio_space = curthread->t_vmspace;
+    int err = (rw == UIO_READ) ? VOP_READ(process->p_files[fd], &u) : VOP_WRITE(process->p_files[fd], &u);
+    if (err) {
+        return err;
+    }
+    process->p_offsets[fd] = u.uio_offset;
+    *retval = len - u.uio_resid;
+    return 0;
+}
+
+void
+process_close_files(void)
+{
+    struct process *process = curthread->p_process;
+    int fd;
+    if (process == NULL) {
+        return;
+    }
+    for (fd = 0; fd < OPEN_MAX; fd++) {
+        if (process->p_files[fd] != NULL) {
+            process_close(fd);
+        }
+    }
+}
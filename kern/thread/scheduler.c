@@ -1,23 +1,70 @@
 /*
  * Scheduler.
  *
- * The default scheduler is very simple, just a round-robin run queue.
- * You'll want to improve it.
+ * Multi-level feedback queue. There is one round-robin run queue per
+ * priority level and the highest non-empty level always runs first.
+ * Each level has a quantum twice as long as the one above it, the top
+ * level gets sched_quantum ticks. A thread is only switched out when
+ * its quantum is up or a thread of a higher level becomes runnable.
+ * A thread that uses up its slice moves down a level, so CPU hogs sink
+ * to the long slices at the bottom. A thread that blocks before its
+ * slice is used up moves up a level when it wakes, so threads waiting
+ * on the console or the disk get the CPU back quickly. Once every
+ * SCHED_BOOST_TICKS all threads go back to the top, so nothing starves.
  */
 
 #include <types.h>
 #include <lib.h>
+#include <kern/errno.h>
 #include <scheduler.h>
 #include <thread.h>
+#include <curthread.h>
+#include <process.h>
+#include <clock.h>
 #include <machine/spl.h>
 #include <queue.h>
+#include "opt-dumbvm.h"
+#if !OPT_DUMBVM
+#include <pagezero.h>
+#endif
 
 /*
  *  Scheduler data
  */
 
-// Queue of runnable threads
-static struct queue *runqueue;
+#define SCHED_LEVELS      4
+#define SCHED_BOOST_TICKS HZ	/* once a second */
+
+/* Default quantum of the top level in ticks, can be changed from the menu. */
+#define SCHED_QUANTUM     1
+#define SCHED_QUANTUM_MAX HZ
+
+/* Quantum of the top level, each level below gets twice as much. */
+static int sched_quantum = SCHED_QUANTUM;
+
+#define SCHED_SLICE(level) (sched_quantum << (level))
+
+// Queues of runnable threads, one per level, level 0 runs first
+static struct queue *runqueues[SCHED_LEVELS];
+
+// Ticks until all threads go back to the top level
+static int boost_countdown;
+
+// Counters shown by print_run_queue
+static unsigned int sched_demotions;
+static unsigned int sched_promotions;
+static unsigned int sched_boosts;
+
+// Ticks since boot, and how many of them the CPU had nothing to run
+static unsigned int sched_ticks;
+static unsigned int sched_idle_ticks;
+
+// Threads on the run queues
+static unsigned int sched_nready;
+
+// Run queue length sampled every tick, bucket i counts lengths below 1<<i (the last one everything longer)
+#define SCHED_HIST_BUCKETS 6
+static unsigned int sched_hist[SCHED_HIST_BUCKETS];
 
 /*
  * Setup function
@@ -25,10 +72,15 @@ static struct queue *runqueue;
 void
 scheduler_bootstrap(void)
 {
-	runqueue = q_create(32);
-	if (runqueue == NULL) {
-		panic("scheduler: Could not create run queue\n");
+	int i;
+
+	for (i=0; i<SCHED_LEVELS; i++) {
+		runqueues[i] = q_create(32);
+		if (runqueues[i] == NULL) {
+			panic("scheduler: Could not create run queue\n");
+		}
 	}
+	boost_countdown = SCHED_BOOST_TICKS;
 }
 
 /*
@@ -41,8 +93,18 @@ scheduler_bootstrap(void)
 int
 scheduler_preallocate(int nthreads)
 {
+	int i, result;
+
 	assert(curspl>0);
-	return q_preallocate(runqueue, nthreads);
+
+	/* Any thread can end up on any level. */
+	for (i=0; i<SCHED_LEVELS; i++) {
+		result = q_preallocate(runqueues[i], nthreads);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
 }
 
 /*
@@ -54,11 +116,17 @@ scheduler_preallocate(int nthreads)
 void
 scheduler_killall(void)
 {
+	int i;
+
 	assert(curspl>0);
-	while (!q_empty(runqueue)) {
-		struct thread *t = q_remhead(runqueue);
-		kprintf("scheduler: Dropping thread %s.\n", t->t_name);
+	for (i=0; i<SCHED_LEVELS; i++) {
+		while (!q_empty(runqueues[i])) {
+			struct thread *t = q_remhead(runqueues[i]);
+			kprintf("scheduler: Dropping thread %s.\n",
+				t->t_name);
+		}
 	}
+	sched_nready = 0;
 }
 
 /*
@@ -71,11 +139,70 @@ scheduler_killall(void)
 void
 scheduler_shutdown(void)
 {
+	int i;
+
 	scheduler_killall();
 
 	assert(curspl>0);
-	q_destroy(runqueue);
-	runqueue = NULL;
+	for (i=0; i<SCHED_LEVELS; i++) {
+		q_destroy(runqueues[i]);
+		runqueues[i] = NULL;
+	}
+}
+
+/*
+ * Start a fresh quantum for a thread at its current level.
+ */
+static
+void
+scheduler_new_quantum(struct thread *t)
+{
+	t->t_ticks = 0;
+	t->t_quantum = SCHED_SLICE(t->t_priority);
+}
+
+/*
+ * Highest level with a runnable thread, SCHED_LEVELS if there is none.
+ */
+static
+int
+scheduler_top_level(void)
+{
+	int i;
+
+	for (i=0; i<SCHED_LEVELS; i++) {
+		if (!q_empty(runqueues[i])) {
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * Move every runnable thread, and the one running, back to the top
+ * level with a fresh time slice.
+ */
+static
+void
+scheduler_boost(void)
+{
+	int i, result;
+
+	for (i=1; i<SCHED_LEVELS; i++) {
+		while (!q_empty(runqueues[i])) {
+			struct thread *t = q_remhead(runqueues[i]);
+			t->t_priority = 0;
+			scheduler_new_quantum(t);
+			/* Preallocated, so this doesn't fail. */
+			result = q_addtail(runqueues[0], t);
+			assert(result==0);
+		}
+	}
+	if (curthread != NULL) {
+		curthread->t_priority = 0;
+		scheduler_new_quantum(curthread);
+	}
+	sched_boosts++;
 }
 
 /*
@@ -89,10 +216,20 @@ scheduler(void)
 {
 	// meant to be called with interrupts off
 	assert(curspl>0);
+
+#if !OPT_DUMBVM
+	/* Nothing to run - let the page zeroing thread have the time. */
+	if (scheduler_idle()) {
+		pagezero_idle();
+	}
+#endif
 	
-	while (q_empty(runqueue)) {
+	/* No timer interrupts until the next deadline while we wait. */
+	while (scheduler_idle()) {
+		hardclock_idle();
 		cpu_idle();
 	}
+	hardclock_resume();
 
 	// You can actually uncomment this to see what the scheduler's
 	// doing - even this deep inside thread code, the console
@@ -101,20 +238,177 @@ scheduler(void)
 	// 
 	//print_run_queue();
 	
-	return q_remhead(runqueue);
+	struct thread *t = q_remhead(runqueues[scheduler_top_level()]);
+	sched_nready--;
+	t->t_waitticks += sched_ticks - t->t_readyat;
+	return t;
 }
 
 /* 
- * Make a thread runnable.
- * With the base scheduler, just add it to the end of the run queue.
+ * Make a thread runnable, at the end of the run queue of its level.
+ * A thread coming back from sleep moves up a level and gets a fresh
+ * time slice.
  */
 int
 make_runnable(struct thread *t)
 {
+	int result;
+
 	// meant to be called with interrupts off
 	assert(curspl>0);
 
-	return q_addtail(runqueue, t);
+	if (t->t_blocked) {
+		t->t_blocked = 0;
+		if (t->t_priority > 0) {
+			t->t_priority--;
+			sched_promotions++;
+		}
+		scheduler_new_quantum(t);
+	}
+	else if (t->t_quantum == 0) {
+		/* New thread */
+		scheduler_new_quantum(t);
+	}
+	result = q_addtail(runqueues[t->t_priority], t);
+	if (result == 0) {
+		sched_nready++;
+		t->t_readyat = sched_ticks;
+	}
+	return result;
+}
+
+/*
+ * Note that a thread is going to sleep, called by the thread system.
+ */
+void
+scheduler_block(struct thread *t)
+{
+	// meant to be called with interrupts off
+	assert(curspl>0);
+
+	t->t_blocked = 1;
+}
+
+/*
+ * Charge TICKS timer ticks to the running thread. Returns nonzero if it
+ * should give up the CPU: its quantum is used up, in which case it
+ * also moves down a level, or a thread of a higher level is waiting.
+ */
+int
+scheduler_tick(int ticks)
+{
+	struct thread *t = curthread;
+	int bucket = 0;
+
+	// meant to be called with interrupts off
+	assert(curspl>0);
+
+	while (bucket < SCHED_HIST_BUCKETS-1 && sched_nready >= (1U << bucket)) {
+		bucket++;
+	}
+	sched_hist[bucket] += ticks;
+	sched_ticks += ticks;
+
+	boost_countdown -= ticks;
+	if (boost_countdown <= 0) {
+		boost_countdown = SCHED_BOOST_TICKS;
+		scheduler_boost();
+	}
+
+	/* Ticks in the idle loop belong to nobody. */
+	if (t == NULL) {
+		sched_idle_ticks += ticks;
+		return 0;
+	}
+	if (t->t_quantum == 0) {
+		/* The boot thread never went through make_runnable */
+		scheduler_new_quantum(t);
+	}
+
+	t->t_ticks += ticks;
+	t->t_runticks += ticks;
+	if (t->t_ticks >= t->t_quantum) {
+		if (t->t_priority < SCHED_LEVELS-1) {
+			t->t_priority++;
+			sched_demotions++;
+		}
+		scheduler_new_quantum(t);
+		return 1;
+	}
+	return scheduler_top_level() < t->t_priority;
+}
+
+/*
+ * Set the quantum of the top level in ticks. Threads pick it up with
+ * their next quantum.
+ */
+int
+scheduler_set_quantum(int ticks)
+{
+	if (ticks < 1 || ticks > SCHED_QUANTUM_MAX) {
+		return EINVAL;
+	}
+	sched_quantum = ticks;
+	return 0;
+}
+
+/*
+ * Return nonzero if nothing is waiting on the run queue.
+ */
+int
+scheduler_idle(void)
+{
+	// meant to be called with interrupts off
+	assert(curspl>0);
+
+	return scheduler_top_level() == SCHED_LEVELS;
+}
+
+/*
+ * Menu command printing scheduler counters and the CPU usage of every
+ * thread.
+ */
+int
+scheduler_stats(int nargs, char **args)
+{
+	int i;
+	unsigned int switches;
+
+	(void)nargs;
+	(void)args;
+
+	/* Turn interrupts off so the counters are consistent. */
+	int spl = splhigh();
+	switches = thread_switch_count();
+
+	kprintf("%u ticks (%u hz), %u idle", sched_ticks, HZ, sched_idle_ticks);
+	if (sched_ticks > 0) {
+		kprintf(" (%u%%)", sched_idle_ticks * 100 / sched_ticks);
+	}
+	kprintf("\n");
+	kprintf("%u context switches", switches);
+	if (sched_ticks >= HZ) {
+		kprintf(", %u/sec", switches / (sched_ticks / HZ));
+	}
+	kprintf("\n");
+	kprintf("Run queue length, ticks:");
+	for (i=0; i<SCHED_HIST_BUCKETS; i++) {
+		if (i == SCHED_HIST_BUCKETS-1) {
+			kprintf(" %u+: %u", 1U << (i-1), sched_hist[i]);
+		}
+		else if (i == 0) {
+			kprintf(" 0: %u", sched_hist[i]);
+		}
+		else {
+			kprintf(" %u-%u: %u", 1U << (i-1), (1U << i) - 1,
+				sched_hist[i]);
+		}
+	}
+	kprintf("\n");
+	process_cpu_stats();
+
+	splx(spl);
+	return 0;
 }
 
 /*
@@ -126,14 +420,22 @@ print_run_queue(void)
 	/* Turn interrupts off so the whole list prints atomically. */
 	int spl = splhigh();
 
-	int i,k=0;
-	i = q_getstart(runqueue);
-	
-	while (i!=q_getend(runqueue)) {
-		struct thread *t = q_getguy(runqueue, i);
-		kprintf("  %2d: %s %p\n", k, t->t_name, t->t_sleepaddr);
-		i=(i+1)%q_getsize(runqueue);
-		k++;
+	int i,k,level;
+
+	kprintf("%u demotions, %u promotions, %u boosts\n",
+		sched_demotions, sched_promotions, sched_boosts);
+	for (level=0; level<SCHED_LEVELS; level++) {
+		struct queue *q = runqueues[level];
+		kprintf("level %d (%d tick quantum):\n", level,
+			SCHED_SLICE(level));
+		k = 0;
+		for (i=q_getstart(q); i!=q_getend(q); i=(i+1)%q_getsize(q)) {
+			struct thread *t = q_getguy(q, i);
+			kprintf("  %2d: %s %p, %d of %d ticks used\n", k,
+				t->t_name, t->t_sleepaddr, t->t_ticks,
+				t->t_quantum);
+			k++;
+		}
 	}
 	
 	splx(spl);
@@ -14,6 +14,18 @@
 //
 // Semaphore.
 
+// Semaphores come and go with every process, they get a cache of their own
+static struct kmem_cache *sem_cache;
+
+void
+sem_bootstrap(void)
+{
+    sem_cache = kmem_cache_create("semaphore", sizeof(struct semaphore), NULL, NULL);
+    if (sem_cache == NULL) {
+        panic("Cannot create semaphore cache\n");
+    }
+}
+
 struct semaphore *
 sem_create(const char *namearg, int initial_count)
 {
@@ -21,18 +33,19 @@ sem_create(const char *namearg, int initial_count)
 
     assert(initial_count >= 0);
 
-    sem = kmalloc(sizeof(struct semaphore));
+    sem = kmem_cache_alloc(sem_cache);
     if (sem == NULL) {
         return NULL;
     }
 
     sem->name = kstrdup(namearg);
     if (sem->name == NULL) {
-        kfree(sem);
+        kmem_cache_free(sem_cache, sem);
         return NULL;
     }
 
     sem->count = initial_count;
+    wchan_init(&sem->wchan);
     return sem;
 }
 
@@ -43,7 +56,7 @@ sem_destroy(struct semaphore *sem)
     assert(sem != NULL);
 
     spl = splhigh();
-    assert(thread_hassleepers(sem)==0);
+    assert(wchan_isempty(&sem->wchan));
     splx(spl);
 
     /*
@@ -56,7 +69,7 @@ sem_destroy(struct semaphore *sem)
      */
 
     kfree(sem->name);
-    kfree(sem);
+    kmem_cache_free(sem_cache, sem);
 }
 
 void
@@ -74,11 +87,12 @@ P(struct semaphore *sem)
     assert(in_interrupt==0);
 
     spl = splhigh();
-    while (sem->count==0) {
-        thread_sleep(sem);
+    if (sem->count > 0) {
+        sem->count--;
+    } else {
+        // V hands its unit straight to the first waiter, so there is nothing to take when we wake up
+        wchan_sleep(&sem->wchan);
     }
-    assert(sem->count>0);
-    sem->count--;
     splx(spl);
 }
 
@@ -88,9 +102,11 @@ V(struct semaphore *sem)
     int spl;
     assert(sem != NULL);
     spl = splhigh();
-    sem->count++;
-    assert(sem->count>0);
-    thread_wakeup(sem);
+    // Waiters are served in FIFO order and only the first one is woken, a later P can't take the unit from it
+    if (wchan_wakeone(&sem->wchan) == NULL) {
+        sem->count++;
+        assert(sem->count>0);
+    }
     splx(spl);
 }
 
@@ -116,6 +132,7 @@ lock_create(const char *name)
 
     lock->flag = 0; // Don't lock the lock initially
     lock->holder = NULL; // No one holds the lock in the beginning
+    wchan_init(&lock->wchan);
     return lock;
 }
 
@@ -127,7 +144,7 @@ lock_destroy(struct lock *lock)
 
     // Disable interrupt, and check if there is still threads sleeping for the lock
     spl = splhigh();
-    assert(thread_hassleepers(lock)==0);
+    assert(wchan_isempty(&lock->wchan));
     splx(spl);
 
     kfree(lock->name);
@@ -141,11 +158,14 @@ lock_acquire(struct lock *lock)
     int spl;
     spl = splhigh();
 
-    while (lock->flag == 1)
-        thread_sleep(lock);
-
-    lock->flag = 1;
-    lock->holder = curthread;
+    if (lock->flag == 1) {
+        // lock_release hands the lock over to us before we wake up
+        wchan_sleep(&lock->wchan);
+        assert(lock->holder == curthread);
+    } else {
+        lock->flag = 1;
+        lock->holder = curthread;
+    }
 
     splx(spl);
 }
@@ -157,9 +177,14 @@ lock_release(struct lock *lock)
     int spl;
     spl = splhigh();
 
-    lock->flag = 0;
-    lock->holder = NULL;
-    thread_wakeup(lock);
+    // FIFO handoff, the longest waiter owns the lock as soon as it's woken and nobody else wakes up for nothing
+    struct thread *next = wchan_wakeone(&lock->wchan);
+    if (next != NULL) {
+        lock->holder = next;
+    } else {
+        lock->flag = 0;
+        lock->holder = NULL;
+    }
 
     splx(spl);
 }
@@ -192,7 +217,7 @@ cv_create(const char *name)
         return NULL;
     }
 
-    // add stuff here as needed
+    wchan_init(&cv->wchan);
 
     return cv;
 }
@@ -200,9 +225,12 @@ cv_create(const char *name)
 void
 cv_destroy(struct cv *cv)
 {
+    int spl;
     assert(cv != NULL);
 
-    // add stuff here as needed
+    spl = splhigh();
+    assert(wchan_isempty(&cv->wchan));
+    splx(spl);
 
     kfree(cv->name);
     kfree(cv);
@@ -216,7 +244,7 @@ cv_wait(struct cv *cv, struct lock *lock)
     spl = splhigh();
 
     lock_release(lock); // We need to release the lock so other threads can run and make this condition true
-    thread_sleep(cv);
+    wchan_sleep(&cv->wchan);
     lock_acquire(lock); // Re-acquire the lock after we wakeup
 
     splx(spl);
@@ -231,7 +259,7 @@ cv_signal(struct cv *cv, struct lock *lock)
     int spl;
     spl = splhigh();
 
-    thread_wakeup(cv); // cv_signal requires us to unblock at least one thread
+    wchan_wakeone(&cv->wchan); // cv_signal only needs to unblock one thread
 
     splx(spl);
 }
@@ -245,7 +273,7 @@ cv_broadcast(struct cv *cv, struct lock *lock)
     int spl;
     spl = splhigh();
 
-    thread_wakeup(cv); // cv_broadcast requires us to unblock all related blocking threads
+    wchan_wakeall(&cv->wchan); // cv_broadcast requires us to unblock all related blocking threads
 
     splx(spl);
 }
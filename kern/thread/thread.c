@@ -27,8 +27,24 @@ typedef enum {
 /* Global variable for the thread currently executing at any given time. */
 struct thread *curthread;
 
-/* Table of sleeping threads. */
-struct array *sleepers;
+/*
+ * Wait channels for threads sleeping on a bare address, hashed by the
+ * address. Threads of different addresses can share a channel, wakeup
+ * only looks at the ones that hashed to it.
+ */
+#define SLEEP_HASH_BITS 6
+#define SLEEP_HASH_SIZE (1 << SLEEP_HASH_BITS)
+#define SLEEP_HASH(addr) ((((u_int32_t)(addr)) * 2654435761U) >> (32 - SLEEP_HASH_BITS))
+static struct wchan sleep_table[SLEEP_HASH_SIZE];
+
+/* Number of threads sleeping on any wait channel. */
+static int numsleepers;
+
+/* Set during panic, sleeping threads are left where they are and never woken. */
+static int sleepers_dropped;
+
+/* Context switches to a different thread. */
+static unsigned int numswitches;
 
 /* List of dead threads to be disposed of. */
 struct array *zombies;
@@ -39,6 +55,9 @@ static int numthreads;
 /* Used so that thread_destroy will not be done before thread_exit. */
 static struct lock *thread_destroy_lock;
 
+/* Where thread structures come from. */
+static struct kmem_cache *thread_cache;
+
 /*
  * Create a thread. This is used both to create the first thread's
  * thread structure and to create subsequent threads.
@@ -48,16 +67,26 @@ static
 struct thread *
 thread_create(const char *name)
 {
-    struct thread *thread = kmalloc(sizeof(struct thread));
+    struct thread *thread = kmem_cache_alloc(thread_cache);
     if (thread==NULL) {
         return NULL;
     }
     thread->t_name = kstrdup(name);
     if (thread->t_name==NULL) {
-        kfree(thread);
+        kmem_cache_free(thread_cache, thread);
         return NULL;
     }
     thread->t_sleepaddr = NULL;
+    thread->t_wchan_next = NULL;
+    thread->t_priority = 0;
+    thread->t_ticks = 0;
+    thread->t_quantum = 0; // The scheduler gives it one when it first needs it
+    thread->t_runticks = 0;
+    thread->t_waitticks = 0;
+    thread->t_readyat = 0;
+    thread->t_nvcsw = 0;
+    thread->t_nivcsw = 0;
+    thread->t_blocked = 0;
     thread->t_stack = NULL;
 
     thread->t_vmspace = NULL;
@@ -67,7 +96,7 @@ thread_create(const char *name)
     struct process *process = process_create(thread);
     if (process==NULL) {
         kfree(thread->t_name);
-        kfree(thread);
+        kmem_cache_free(thread_cache, thread);
     }
 
     return thread;
@@ -94,7 +123,7 @@ thread_destroy(struct thread *thread)
     }
 
     kfree(thread->t_name);
-    kfree(thread);
+    kmem_cache_free(thread_cache, thread);
     lock_release(thread_destroy_lock);
 }
 
@@ -133,32 +162,29 @@ static
 void
 thread_killall(void)
 {
-    int i, result;
+    int i;
+    struct thread *t;
 
     assert(curspl>0);
 
     /*
-     * Move all sleepers to the zombie list, to be sure they don't
-     * wake up while we're shutting down.
+     * Make sure sleepers don't wake up while we're shutting down.
+     * Threads on the wait channels of synchronization primitives
+     * can't be listed, only the ones sleeping on bare addresses.
+     *
+     * Don't move them to the zombie list: because these threads
+     * haven't been through thread_exit, thread_destroy will get
+     * upset. Just drop the threads on the floor, which is safer
+     * anyway during panic.
      */
 
-    for (i=0; i<array_getnum(sleepers); i++) {
-        struct thread *t = array_getguy(sleepers, i);
-        kprintf("sleep: Dropping thread %s\n", t->t_name);
-
-        /*
-         * Don't do this: because these threads haven't
-         * been through thread_exit, thread_destroy will
-         * get upset. Just drop the threads on the floor,
-         * which is safer anyway during panic.
-         *
-         * array_add(zombies, t);
-         */
+    for (i=0; i<SLEEP_HASH_SIZE; i++) {
+        for (t = sleep_table[i].wc_head; t != NULL; t = t->t_wchan_next) {
+            kprintf("sleep: Dropping thread %s\n", t->t_name);
+        }
     }
-
-    result = array_setsize(sleepers, 0);
-    /* shrinking array: not supposed to fail */
-    assert(result==0);
+    kprintf("sleep: Dropping %d sleeping threads\n", numsleepers);
+    sleepers_dropped = 1;
 }
 
 /*
@@ -180,6 +206,13 @@ struct thread *
 thread_bootstrap(void)
 {
     struct thread *me;
+    int i;
+
+    thread_cache = kmem_cache_create("thread", sizeof(struct thread), NULL, NULL);
+    if (thread_cache == NULL) {
+        panic("Cannot create thread cache\n");
+    }
+    sem_bootstrap();
 
     thread_destroy_lock = lock_create("thread_destroy_lock");
     if (thread_destroy_lock == NULL) {
@@ -187,10 +220,11 @@ thread_bootstrap(void)
     }
 
     /* Create the data structures we need. */
-    sleepers = array_create();
-    if (sleepers==NULL) {
-        panic("Cannot create sleepers array\n");
+    for (i=0; i<SLEEP_HASH_SIZE; i++) {
+        wchan_init(&sleep_table[i]);
     }
+    numsleepers = 0;
+    sleepers_dropped = 0;
 
     zombies = array_create();
     if (zombies==NULL) {
@@ -232,8 +266,6 @@ thread_bootstrap(void)
 void
 thread_shutdown(void)
 {
-    array_destroy(sleepers);
-    sleepers = NULL;
     array_destroy(zombies);
     zombies = NULL;
     process_shutdown();
@@ -265,7 +297,7 @@ thread_fork(const char *name,
     newguy->t_stack = kmalloc(STACK_SIZE);
     if (newguy->t_stack==NULL) {
         kfree(newguy->t_name);
-        kfree(newguy);
+        kmem_cache_free(thread_cache, newguy);
         return ENOMEM;
     }
 
@@ -291,10 +323,6 @@ thread_fork(const char *name,
      * Make sure our data structures have enough space, so we won't
      * run out later at an inconvenient time.
      */
-    result = array_preallocate(sleepers, numthreads+1);
-    if (result) {
-        goto fail;
-    }
     result = array_preallocate(zombies, numthreads+1);
     if (result) {
         goto fail;
@@ -342,7 +370,7 @@ thread_fork(const char *name,
     }
     kfree(newguy->t_stack);
     kfree(newguy->t_name);
-    kfree(newguy);
+    kmem_cache_free(thread_cache, newguy);
 
     return result;
 }
@@ -394,11 +422,9 @@ mi_switch(threadstate_t nextstate)
         result = make_runnable(cur);
     }
     else if (nextstate==S_SLEEP) {
-        /*
-         * Because we preallocate sleepers[] during thread_fork,
-         * this should never fail.
-         */
-        result = array_add(sleepers, cur);
+        /* Already queued on its wait channel by wchan_block. */
+        scheduler_block(cur);
+        result = 0;
     }
     else {
         assert(nextstate==S_ZOMB);
@@ -411,6 +437,15 @@ mi_switch(threadstate_t nextstate)
      */
 
     next = scheduler();
+    if (next != cur) {
+        numswitches++;
+        // Yields from the timer interrupt are preemptions, everything else the thread asked for
+        if (nextstate == S_READY && in_interrupt) {
+            cur->t_nivcsw++;
+        } else if (nextstate != S_ZOMB) {
+            cur->t_nvcsw++;
+        }
+    }
 
     /* update curthread */
     curthread = next;
@@ -474,6 +509,9 @@ thread_exit(void)
         as_destroy(as);
     }
 
+    // Open files go with the process, mappings hold references of their own
+    process_close_files();
+
     if (curthread->t_cwd) {
         VOP_DECREF(curthread->t_cwd);
         curthread->t_cwd = NULL;
@@ -496,13 +534,118 @@ thread_yield(void)
 {
     int spl = splhigh();
 
-    /* Check sleepers just in case we get here after shutdown */
-    assert(sleepers != NULL);
+    /* Check zombies just in case we get here after shutdown */
+    assert(zombies != NULL);
 
     mi_switch(S_READY);
     splx(spl);
 }
 
+/*
+ * Queue the current thread at the tail of a wait channel and switch
+ * away until someone takes it off the channel.
+ */
+static
+void
+wchan_block(struct wchan *wc)
+{
+    // may not sleep in an interrupt handler
+    assert(in_interrupt==0);
+    assert(curspl>0);
+
+    curthread->t_wchan_next = NULL;
+    if (wc->wc_tail != NULL) {
+        wc->wc_tail->t_wchan_next = curthread;
+    } else {
+        wc->wc_head = curthread;
+    }
+    wc->wc_tail = curthread;
+    numsleepers++;
+
+    mi_switch(S_SLEEP);
+}
+
+/*
+ * Take thread T off a wait channel and make it runnable. PREV is the
+ * thread before it on the channel, NULL if T is first.
+ */
+static
+void
+wchan_wake(struct wchan *wc, struct thread *prev, struct thread *t)
+{
+    int result;
+
+    if (prev != NULL) {
+        prev->t_wchan_next = t->t_wchan_next;
+    } else {
+        wc->wc_head = t->t_wchan_next;
+    }
+    if (wc->wc_tail == t) {
+        wc->wc_tail = prev;
+    }
+    t->t_wchan_next = NULL;
+    numsleepers--;
+
+    /*
+     * Because we preallocate during thread_fork,
+     * this should never fail.
+     */
+    result = make_runnable(t);
+    assert(result==0);
+}
+
+void
+wchan_init(struct wchan *wc)
+{
+    wc->wc_head = NULL;
+    wc->wc_tail = NULL;
+}
+
+void
+wchan_sleep(struct wchan *wc)
+{
+    curthread->t_sleepaddr = wc; // Only for diagnostics
+    wchan_block(wc);
+    curthread->t_sleepaddr = NULL;
+}
+
+void
+wchan_wakeall(struct wchan *wc)
+{
+    // meant to be called with interrupts off
+    assert(curspl>0);
+
+    if (sleepers_dropped) {
+        return;
+    }
+    while (wc->wc_head != NULL) {
+        wchan_wake(wc, NULL, wc->wc_head);
+    }
+}
+
+struct thread *
+wchan_wakeone(struct wchan *wc)
+{
+    // meant to be called with interrupts off
+    assert(curspl>0);
+
+    struct thread *t = wc->wc_head;
+    if (sleepers_dropped || t == NULL) {
+        return NULL;
+    }
+    wchan_wake(wc, NULL, t);
+    return t;
+}
+
+int
+wchan_isempty(struct wchan *wc)
+{
+    // meant to be called with interrupts off
+    assert(curspl>0);
+
+    return wc->wc_head == NULL;
+}
+
 /*
  * Yield the cpu to another process, and go to sleep, on "sleep
  * address" ADDR. Subsequent calls to thread_wakeup with the same
@@ -517,46 +660,65 @@ thread_yield(void)
 void
 thread_sleep(const void *addr)
 {
-    // may not sleep in an interrupt handler
-    assert(in_interrupt==0);
-
     curthread->t_sleepaddr = addr;
-    mi_switch(S_SLEEP);
+    wchan_block(&sleep_table[SLEEP_HASH(addr)]);
     curthread->t_sleepaddr = NULL;
 }
 
 /*
  * Wake up one or more threads who are sleeping on "sleep address"
- * ADDR.
+ * ADDR. Only the threads on ADDR's wait channel are looked at, and
+ * they are woken in the order they went to sleep.
  */
 void
 thread_wakeup(const void *addr)
 {
-    int i, result;
-
     // meant to be called with interrupts off
     assert(curspl>0);
 
-    // This is inefficient. Feel free to improve it.
+    if (sleepers_dropped) {
+        return;
+    }
 
-    for (i=0; i<array_getnum(sleepers); i++) {
-        struct thread *t = array_getguy(sleepers, i);
+    struct wchan *wc = &sleep_table[SLEEP_HASH(addr)];
+    struct thread *prev = NULL;
+    struct thread *t = wc->wc_head;
+    while (t != NULL) {
+        struct thread *next = t->t_wchan_next;
         if (t->t_sleepaddr == addr) {
+            wchan_wake(wc, prev, t);
+        } else {
+            prev = t;
+        }
+        t = next;
+    }
+}
 
-            // Remove from list
-            array_remove(sleepers, i);
+/*
+ * Wake up the thread that has been sleeping longest on "sleep address"
+ * ADDR, the others stay asleep.
+ */
+int
+thread_wakeone(const void *addr)
+{
+    // meant to be called with interrupts off
+    assert(curspl>0);
 
-            // must look at the same sleepers[i] again
-            i--;
+    if (sleepers_dropped) {
+        return 0;
+    }
 
-            /*
-             * Because we preallocate during thread_fork,
-             * this should never fail.
-             */
-            result = make_runnable(t);
-            assert(result==0);
+    struct wchan *wc = &sleep_table[SLEEP_HASH(addr)];
+    struct thread *prev = NULL;
+    struct thread *t;
+    for (t = wc->wc_head; t != NULL; t = t->t_wchan_next) {
+        if (t->t_sleepaddr == addr) {
+            wchan_wake(wc, prev, t);
+            return 1;
         }
+        prev = t;
     }
+    return 0;
 }
 
 /*
@@ -566,13 +728,12 @@ thread_wakeup(const void *addr)
 int
 thread_hassleepers(const void *addr)
 {
-    int i;
+    struct thread *t;
 
     // meant to be called with interrupts off
     assert(curspl>0);
 
-    for (i=0; i<array_getnum(sleepers); i++) {
-        struct thread *t = array_getguy(sleepers, i);
+    for (t = sleep_table[SLEEP_HASH(addr)].wc_head; t != NULL; t = t->t_wchan_next) {
         if (t->t_sleepaddr == addr) {
             return 1;
         }
@@ -580,6 +741,12 @@ thread_hassleepers(const void *addr)
     return 0;
 }
 
+unsigned int
+thread_switch_count(void)
+{
+    return numswitches;
+}
+
 /*
  * New threads actually come through here on the way to the function
  * they're supposed to start in. This is so when that function exits,
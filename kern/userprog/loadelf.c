@@ -83,7 +83,7 @@ load_segment(struct vnode *v, off_t offset, vaddr_t vaddr,
 
 static
 int
-load_segment_on_demand(struct vnode *v, int index, off_t offset, vaddr_t vaddr,
+load_segment_on_demand(struct vnode *v, off_t offset, vaddr_t vaddr,
          size_t memsize, size_t filesize,
          int is_executable)
 {
@@ -106,7 +106,10 @@ load_segment_on_demand(struct vnode *v, int index, off_t offset, vaddr_t vaddr,
     u.uio_space = curthread->t_vmspace;
 
     // Now instead of actually loading the segment, we store the data structures in as_segment
-    struct as_segment *seg = array_getguy(curthread->t_vmspace->as_segments, index);
+    struct as_segment *seg = as_segment_lookup(curthread->t_vmspace, vaddr);
+    if (seg == NULL) {
+        return 0; // Empty segment, as_define_region didn't map anything
+    }
     seg->vnode = v;
     seg->uio = u;
     return 0;
@@ -377,7 +380,6 @@ load_elf_on_demand(struct vnode *v, vaddr_t *entrypoint)
      * Now actually load each segment.
      */
 
-    int counter = 0;
     for (i=0; i<eh.e_phnum; i++) {
         off_t offset = eh.e_phoff + i*eh.e_phentsize;
         mk_kuio(&ku, &ph, sizeof(ph), offset, UIO_READ);
@@ -404,13 +406,12 @@ load_elf_on_demand(struct vnode *v, vaddr_t *entrypoint)
             return ENOEXEC;
         }
 
-        result = load_segment_on_demand(v, counter, ph.p_offset, ph.p_vaddr,
+        result = load_segment_on_demand(v, ph.p_offset, ph.p_vaddr,
                       ph.p_memsz, ph.p_filesz,
                       ph.p_flags & PF_X);
         if (result) {
             return result;
         }
-        counter++;
     }
 
     result = as_complete_load(curthread->t_vmspace);
@@ -424,46 +425,55 @@ load_elf_on_demand(struct vnode *v, vaddr_t *entrypoint)
 }
 
 int
-load_page_on_demand(struct vnode *v, struct uio u, off_t page_offset)
+load_page_on_demand(struct vnode *v, struct uio u, off_t page_offset, paddr_t paddr)
 {
-    // 1. Calculate the new vaddr base
-    // 2. Determine the filesize for reading
-    // 3. Zero-fill based on memsize
-    u.uio_iovec.iov_ubase += page_offset;
-
-    assert((int)(u.uio_iovec.iov_len) - (int)page_offset >= 0);
-    size_t memsize = u.uio_iovec.iov_len; // Length of the memory space
-    size_t filesize = u.uio_resid; // Amount to actually read
-    off_t offset = u.uio_offset;
-    u.uio_iovec.iov_len =  (memsize - page_offset > PAGE_SIZE) ? PAGE_SIZE : (memsize - page_offset);
-    if ((int)filesize - (int)page_offset < 0) {
-        u.uio_resid = 0;
-    } else {
-        u.uio_resid = (filesize - page_offset > PAGE_SIZE) ? PAGE_SIZE : (filesize - page_offset);
+    // PAGE_OFFSET is relative to the page-aligned base of the segment, but the segment's data starts at
+    // p_vaddr, which needn't be page-aligned. So work out which part of this page the segment covers,
+    // read and zero-fill just that, and zero the rest of the frame
+    // Everything goes through the kernel mapping of the physical page, a write through the user mapping would dirty the page
+    vaddr_t segstart = (vaddr_t)u.uio_iovec.iov_ubase;
+    vaddr_t memend = segstart + u.uio_iovec.iov_len; // End of the memory space
+    vaddr_t fileend = segstart + u.uio_resid; // End of what is actually read
+    vaddr_t pagestart = (segstart & PAGE_FRAME) + page_offset;
+    vaddr_t pageend = pagestart + PAGE_SIZE;
+    char *kbase = (char *)PADDR_TO_KVADDR(paddr);
+
+    vaddr_t start = (segstart > pagestart) ? segstart : pagestart;
+    vaddr_t end = (memend < pageend) ? memend : pageend;
+    vaddr_t readend = (fileend < end) ? fileend : end;
+    assert(start < pageend);
+    if (end < start) {
+        end = start;
     }
-    u.uio_offset = offset + page_offset;
-    memsize = u.uio_iovec.iov_len;
-    filesize = u.uio_resid;
-
-    int result = VOP_READ(v, &u);
-    if (result) {
-        return result;
+    if (readend < start) {
+        readend = start;
     }
 
-    if (u.uio_resid != 0) {
-        /* short read; problem with executable? */
-        kprintf("ELF: short read on segment - file truncated?\n");
-        return ENOEXEC;
+    bzero(kbase, start - pagestart);
+    bzero(kbase + (end - pagestart), pageend - end);
+
+    if (readend > start) {
+        struct uio ku;
+        mk_kuio(&ku, kbase + (start - pagestart), readend - start,
+                u.uio_offset + (start - segstart), UIO_READ);
+        int result = VOP_READ(v, &ku);
+        if (result) {
+            return result;
+        }
+
+        if (ku.uio_resid != 0) {
+            /* short read; problem with executable? */
+            kprintf("ELF: short read on segment - file truncated?\n");
+            return ENOEXEC;
+        }
     }
 
     /* Fill the rest of the memory space (if any) with zeros */
-    size_t fillamt = memsize - filesize;
-    if (fillamt > 0) {
+    if (end > readend) {
         DEBUG(DB_EXEC, "ELF: Zero-filling %lu more bytes\n",
-              (unsigned long) fillamt);
-        u.uio_resid += fillamt;
-        result = uiomovezeros(fillamt, &u);
+              (unsigned long) (end - readend));
+        bzero(kbase + (readend - pagestart), end - readend);
     }
 
-    return result;
+    return 0;
 }
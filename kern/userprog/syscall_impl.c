@@ -4,13 +4,16 @@
 #include <kern/limits.h>
 #include <kern/errno.h>
 #include <kern/unistd.h>
+#include <kern/mman.h>
 #include <clock.h>
+#include <vfs.h>
 #include <syscall.h>
 #include <swap.h>
 #include <addrspace.h>
 #include <thread.h>
 #include <curthread.h>
 #include <process.h>
+#include <synch.h>
 
 int
 sys__exit(int exitcode)
@@ -112,10 +115,12 @@ sys_waitpid(pid_t pid, int *status, int options, pid_t *retval)
 int
 sys_read(int fd, void *buf, size_t buflen, int *retval)
 {
-    if (fd != STDIN_FILENO) {
-        //kprintf("Right now read system call only support read from STDIN\n");
-        *retval = -1;
-        return EBADF;
+    if (fd != STDIN_FILENO) { // Files from open, anything else isn't open
+        int err = process_file_io(fd, (userptr_t)buf, buflen, UIO_READ, retval);
+        if (err) {
+            *retval = -1;
+        }
+        return err;
     }
     if (buflen != 1) {
         //kprintf("Right now read system call only support read one character\n");
@@ -136,10 +141,12 @@ sys_read(int fd, void *buf, size_t buflen, int *retval)
 int
 sys_write(int fd, const void *buf, size_t nbytes, int *retval)
 {
-    if (fd != STDOUT_FILENO && fd != STDERR_FILENO) {
-        //kprintf("Right now write system call only support write to STDOUT and STDERR\n");
-        *retval = -1;
-        return EBADF;
+    if (fd != STDOUT_FILENO && fd != STDERR_FILENO) { // Files from open, anything else isn't open
+        int err = process_file_io(fd, (userptr_t)buf, nbytes, UIO_WRITE, retval);
+        if (err) {
+            *retval = -1;
+        }
+        return err;
     }
     char *kern_buf = (char*)kmalloc(sizeof(char) * (nbytes + 1)); // Additional space for NULL at the end
     int err = copyin((const_userptr_t)buf, (void *)kern_buf, nbytes);
@@ -176,8 +183,15 @@ sys_sbrk(intptr_t amount, void **retval)
         return ENOMEM;
     }
     */
+    size_t heapsize = amount + (int)as->as_heapsize;
+    assert(as->as_heap != NULL);
+    if (as_segment_resize(as, as->as_heap, (heapsize + PAGE_SIZE - 1) / PAGE_SIZE)) { // Would run into the next segment
+        *retval = ((void *)-1);
+        splx(spl);
+        return ENOMEM;
+    }
     *retval = (void *)(as->as_heapbase + as->as_heapsize);
-    as->as_heapsize = amount + (int)as->as_heapsize;
+    as->as_heapsize = heapsize;
     splx(spl);
     return 0;
 }
@@ -212,3 +226,126 @@ sys___time(time_t *seconds, unsigned long *nanoseconds, time_t *retval)
     }
     return 0;
 }
+
+int
+sys_open(const char *path, int flags, int *retval)
+{
+    char k_path[PATH_MAX];
+    size_t actual_length;
+    int err = copyinstr((const_userptr_t)path, k_path, PATH_MAX, &actual_length);
+    if (err) {
+        *retval = -1;
+        return err;
+    }
+    err = process_open(k_path, flags, retval);
+    if (err) {
+        *retval = -1;
+        return err;
+    }
+    return 0;
+}
+
+int
+sys_close(int fd)
+{
+    return process_close(fd);
+}
+
+int
+sys_sync(void)
+{
+    struct addrspace *as = curthread->t_vmspace;
+    int spl = splhigh();
+    lock_acquire(as->as_lock);
+    as_sync(as, 0, USERTOP);
+    lock_release(as->as_lock);
+    splx(spl);
+    return vfs_sync();
+}
+
+int
+sys_mmap(void *addr, size_t len, int prot, int flags, userptr_t stackargs, void **retval)
+{
+    int fd;
+    off_t offset;
+    int mode;
+    vaddr_t vaddr;
+
+    (void)addr; // Only a hint, the kernel picks the address
+    *retval = MAP_FAILED;
+
+    int err = copyin(stackargs, &fd, sizeof(int));
+    if (err) {
+        return err;
+    }
+    err = copyin(stackargs + sizeof(int), &offset, sizeof(off_t));
+    if (err) {
+        return err;
+    }
+
+    // A length past the user address space would also overflow when rounded up to pages
+    if (len == 0 || len > USERTOP || offset < 0 || (offset & ~PAGE_FRAME) != 0) {
+        return EINVAL;
+    }
+    if ((flags != MAP_SHARED && flags != MAP_PRIVATE) || (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0) {
+        return EINVAL;
+    }
+    struct vnode *v = process_file(fd, &mode);
+    if (v == NULL) {
+        return EBADF;
+    }
+    // Pages are always read from the file, and a shared writable mapping writes to it
+    if (mode == O_WRONLY || (flags == MAP_SHARED && (prot & PROT_WRITE) && mode != O_RDWR)) {
+        return EACCES;
+    }
+
+    struct addrspace *as = curthread->t_vmspace;
+    int spl = splhigh();
+    lock_acquire(as->as_lock);
+    err = as_define_mapping(as, v, offset, len, prot, flags == MAP_SHARED, &vaddr);
+    lock_release(as->as_lock);
+    splx(spl);
+    if (err) {
+        return err;
+    }
+    *retval = (void *)vaddr;
+    return 0;
+}
+
+int
+sys_munmap(void *addr, size_t len)
+{
+    struct addrspace *as = curthread->t_vmspace;
+    int spl = splhigh();
+    lock_acquire(as->as_lock);
+    int err = as_unmap(as, (vaddr_t)addr, len);
+    lock_release(as->as_lock);
+    splx(spl);
+    return err;
+}
+
+int
+sys_msync(void *addr, size_t len, int flags)
+{
+    if ((flags != MS_SYNC && flags != MS_ASYNC) || ((vaddr_t)addr & ~PAGE_FRAME) != 0) {
+        return EINVAL;
+    }
+    struct addrspace *as = curthread->t_vmspace;
+    int spl = splhigh();
+    lock_acquire(as->as_lock);
+    int err = as_sync(as, (vaddr_t)addr, len);
+    lock_release(as->as_lock);
+    splx(spl);
+    return err;
+}
+
+int
+sys_getrusage(int who, userptr_t usage)
+{
+    struct rusage ru;
+    int err = process_getrusage(who, &ru);
+    if (err) {
+        return err;
+    }
+    return copyout((const void *)&ru, usage, sizeof(struct rusage));
+}
@@ -11,11 +11,58 @@
 #include <curthread.h>
 #include <thread.h>
 #include <vfs.h>
+#include <vnode.h>
+#include <kern/stat.h>
+
+// ASID allocator, ASIDs are handed out in order and all of them are recycled at once by starting a new generation
+// ASID 0 is never used so the invalid entries written at boot never match user space
+static unsigned int asid_next = 1;
+static unsigned int asid_generation = 1;
+
+// Every fork and exec makes an address space and a few regions, they come from caches of their own
+static struct kmem_cache *as_cache;
+static struct kmem_cache *as_segment_cache;
+
+void
+as_bootstrap(void)
+{
+    as_cache = kmem_cache_create("addrspace", sizeof(struct addrspace), NULL, NULL);
+    as_segment_cache = kmem_cache_create("as_segment", sizeof(struct as_segment), NULL, NULL);
+    if (as_cache == NULL || as_segment_cache == NULL) {
+        panic("Unable to create address space caches\n");
+    }
+}
+
+// Whether entries of this address space may still be in the TLB under its ASID
+static
+int
+as_asid_current(struct addrspace *as)
+{
+    return as->as_asid_generation == asid_generation;
+}
+
+// Invalidate every TLB entry tagged with the address space's ASID
+static
+void
+as_tlb_invalidate(struct addrspace *as)
+{
+    u_int32_t ehi, elo;
+    int i;
+    if (!as_asid_current(as)) {
+        return;
+    }
+    for (i = 0; i < NUM_TLB; i++) {
+        TLB_Read(&ehi, &elo, i);
+        if ((elo & TLBLO_VALID) && ((ehi & TLBHI_PID) >> TLBHI_PIDSHIFT) == as->as_asid) {
+            TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+        }
+    }
+}
 
 struct addrspace *
 as_create(void)
 {
-    struct addrspace *as = kmalloc(sizeof(struct addrspace));
+    struct addrspace *as = kmem_cache_alloc(as_cache);
     if (as==NULL) {
         return NULL;
     }
@@ -25,68 +72,203 @@ as_create(void)
         return NULL;
     }
     as->as_segments = a;
-    // We pre-allocate 2 segments for the array which should be enough
-    int err = array_preallocate(as->as_segments, 2);
+    // We pre-allocate 4 segments for the array, code, data, heap and stack
+    int err = array_preallocate(as->as_segments, 4);
     if (err) {
         array_destroy(as->as_segments);
-        kfree(as);
+        kmem_cache_free(as_cache, as);
         return NULL;
     }
 
-    // Create an empty array
-    a = array_create();
-    if (a == NULL) {
+    // Empty page directory, second level tables are allocated on first touch
+    as->page_dir = kmalloc(PT_L1_ENTRIES * sizeof(struct page_table_entry *));
+    if (as->page_dir == NULL) {
+        array_destroy(as->as_segments);
+        kmem_cache_free(as_cache, as);
         return NULL;
     }
-    as->page_table = a;
+    bzero(as->page_dir, PT_L1_ENTRIES * sizeof(struct page_table_entry *));
 
-    err = array_preallocate(as->page_table, 512);
-    if (err) {
+    as->as_lock = lock_create("as_lock");
+    if (as->as_lock == NULL) {
+        kfree(as->page_dir);
         array_destroy(as->as_segments);
-        array_destroy(as->page_table);
-        kfree(as);
+        kmem_cache_free(as_cache, as);
         return NULL;
     }
 
+    as->as_heap = NULL;
     as->as_heapbase = 0;
     as->as_heapsize = 0;
+    as->as_asid = 0;
+    as->as_asid_generation = 0; // Never current, first as_activate assigns one
+    as->as_ra_next = 0;
+    as->as_ra_window = 0;
+    as->as_faults = 0;
+    as->as_major_faults = 0;
+    coremap_as_register(as);
 
     return as;
 }
 
+// Release the page or swap page behind a valid pte and invalidate it
+static
+void
+as_free_pte(struct page_table_entry *e)
+{
+    while (!e->swapped && coremap_page_busy(e->pframe << PAGE_SHIFT)) {
+        // Someone is still writing the page out(or copying it), it's not ours to free until they are done
+        coremap_page_wait(e->pframe << PAGE_SHIFT);
+    }
+    if (!e->valid) { // Clean executable page that got dropped
+        return;
+    }
+    if (e->swapped) {
+        // If the page is currently in swap
+        swap_free_page(e->swap_file_frame);
+    } else {
+        // Change the corresponding coremap entry
+        coremap_free_page(e->pframe << PAGE_SHIFT, e);
+    }
+    e->valid = 0;
+}
+
+// Drop a segment the page table no longer refers to
+static
+void
+as_segment_free(struct as_segment *seg)
+{
+    if (seg->flags & AS_SEG_MMAP) {
+        VOP_DECREF(seg->vnode);
+    }
+    kmem_cache_free(as_segment_cache, seg);
+}
+
 void
 as_destroy(struct addrspace *as)
 {
     assert(as != NULL); // What are you doing?
     int spl = splhigh();
-    // Iterate through all the segments and free them
     int i;
+
+    lock_acquire(as->as_lock);
+    // Whatever was written to shared mappings goes back to the files first
     for (i = 0; i < array_getnum(as->as_segments); i++) {
         struct as_segment *seg = array_getguy(as->as_segments, i);
-        kfree(seg);
+        if (seg->flags & AS_SEG_SHARED) {
+            vm_sync_segment(as, seg);
+        }
     }
-    array_destroy(as->as_segments);
 
-    lock_acquire(vm_fault_lock);
     // Free page table entries
-    for (i = 0; i < array_getnum(as->page_table); i++) {
-        struct page_table_entry *e = array_getguy(as->page_table, i);
-        if (e->swapped) {
-            // If the page is currently in swap
-            swap_free_page(e->swap_file_frame);
-        } else {
-            // Change the corresponding coremap entry
-            coremap_free_page(e->pframe << PAGE_SHIFT, e);
+    unsigned int l1, l2;
+    for (l1 = 0; l1 < PT_L1_ENTRIES; l1++) {
+        struct page_table_entry *table = as->page_dir[l1];
+        if (table == NULL) {
+            continue;
         }
-        kfree(e);
+        for (l2 = 0; l2 < PT_L2_ENTRIES; l2++) {
+            struct page_table_entry *e = &table[l2];
+            if (e->valid) {
+                as_free_pte(e);
+            }
+        }
+        kfree(table);
+    }
+    kfree(as->page_dir);
+    lock_release(as->as_lock);
+    lock_destroy(as->as_lock);
+
+    // Iterate through all the segments and free them
+    for (i = 0; i < array_getnum(as->as_segments); i++) {
+        as_segment_free(array_getguy(as->as_segments, i));
     }
-    array_destroy(as->page_table);
-    lock_release(vm_fault_lock);
+    array_destroy(as->as_segments);
 
-    kfree(as);
+    // The ASID won't be reused in this generation, but don't leave dead entries taking up slots
+    as_tlb_invalidate(as);
+
+    coremap_as_unregister(as);
+    kmem_cache_free(as_cache, as);
     splx(spl);
 }
 
+unsigned int
+as_swapped_pages(struct addrspace *as)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    unsigned int l1, l2;
+    unsigned int count = 0;
+    for (l1 = 0; l1 < PT_L1_ENTRIES; l1++) {
+        struct page_table_entry *table = as->page_dir[l1];
+        if (table == NULL) {
+            continue;
+        }
+        for (l2 = 0; l2 < PT_L2_ENTRIES; l2++) {
+            if (table[l2].valid && table[l2].swapped) {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+struct page_table_entry *
+as_pte_lookup(struct addrspace *as, vaddr_t vaddr)
+{
+    assert(vaddr < USERTOP);
+    struct page_table_entry *table = as->page_dir[PT_L1_INDEX(vaddr)];
+    if (table == NULL) {
+        return NULL;
+    }
+    struct page_table_entry *e = &table[PT_L2_INDEX(vaddr)];
+    if (!e->valid) {
+        return NULL;
+    }
+    return e;
+}
+
+struct page_table_entry *
+as_pte_create(struct addrspace *as, vaddr_t vaddr)
+{
+    assert(vaddr < USERTOP);
+    struct page_table_entry *table = as->page_dir[PT_L1_INDEX(vaddr)];
+    if (table == NULL) {
+        // One page worth of entries, kmalloc hands out whole pages for this size
+        table = kmalloc(PT_L2_ENTRIES * sizeof(struct page_table_entry));
+        if (table == NULL) {
+            return NULL;
+        }
+        bzero(table, PT_L2_ENTRIES * sizeof(struct page_table_entry));
+        as->page_dir[PT_L1_INDEX(vaddr)] = table;
+    }
+    struct page_table_entry *e = &table[PT_L2_INDEX(vaddr)];
+    assert(!e->valid);
+    return e;
+}
+
+u_int32_t
+as_tlbhi(struct addrspace *as, vaddr_t vaddr)
+{
+    assert(as_asid_current(as));
+    return (vaddr & TLBHI_VPAGE) | (as->as_asid << TLBHI_PIDSHIFT);
+}
+
+void
+as_tlb_unload(struct addrspace *as, vaddr_t vaddr)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    if (!as_asid_current(as)) { // Nothing of ours survived the last generation flush
+        return;
+    }
+    int tlb_index = TLB_Probe((vaddr & TLBHI_VPAGE) | (as->as_asid << TLBHI_PIDSHIFT), 0); // elo not used pass 0
+    if (tlb_index >= 0) {
+        TLB_Write(TLBHI_INVALID(tlb_index), TLBLO_INVALID(), tlb_index);
+    }
+}
+
 void
 as_activate(struct addrspace *as)
 {
@@ -100,11 +282,131 @@ as_activate(struct addrspace *as)
         seg->uio.uio_space = curthread->t_vmspace;
     }
 
-    TLB_Flush();
+    if (!as_asid_current(as)) {
+        if (asid_next == NUM_TLB_PID) {
+            // Out of ASIDs, start a new generation so everyone gets a fresh one when they next run
+            TLB_Flush();
+            asid_generation++;
+            asid_next = 1;
+        }
+        as->as_asid = asid_next++;
+        as->as_asid_generation = asid_generation;
+    }
+    TLB_SetPID(as->as_asid);
 
     splx(spl);
 }
 
+// Index of the last segment starting at or below vaddr, -1 if there is none
+static
+int
+as_segment_search(struct addrspace *as, vaddr_t vaddr)
+{
+    int lo = 0;
+    int hi = array_getnum(as->as_segments) - 1;
+    int found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        struct as_segment *seg = array_getguy(as->as_segments, mid);
+        if (seg->vbase <= vaddr) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+struct as_segment *
+as_segment_lookup(struct addrspace *as, vaddr_t vaddr)
+{
+    int i = as_segment_search(as, vaddr);
+    if (i < 0) {
+        return NULL;
+    }
+    // Segments don't overlap, so the one below is the only one that can hold the address
+    struct as_segment *seg = array_getguy(as->as_segments, i);
+    if (vaddr - seg->vbase >= seg->npages * PAGE_SIZE) {
+        return NULL;
+    }
+    return seg;
+}
+
+// Insert the segment keeping as_segments sorted, segments may not overlap or start at the same address
+static
+int
+as_segment_insert(struct addrspace *as, struct as_segment *seg)
+{
+    int i = as_segment_search(as, seg->vbase);
+    int num = array_getnum(as->as_segments);
+    if (i >= 0) {
+        struct as_segment *prev = array_getguy(as->as_segments, i);
+        if (prev->vbase == seg->vbase || prev->vbase + prev->npages * PAGE_SIZE > seg->vbase) {
+            return EINVAL;
+        }
+    }
+    if (i + 1 < num) {
+        struct as_segment *next = array_getguy(as->as_segments, i + 1);
+        if (seg->vbase + seg->npages * PAGE_SIZE > next->vbase) {
+            return EINVAL;
+        }
+    }
+
+    int err = array_add(as->as_segments, seg);
+    if (err) {
+        return err;
+    }
+    // Shift everything above the new segment up by one
+    int j;
+    for (j = num; j > i + 1; j--) {
+        array_setguy(as->as_segments, j, array_getguy(as->as_segments, j - 1));
+    }
+    array_setguy(as->as_segments, i + 1, seg);
+    return 0;
+}
+
+int
+as_segment_resize(struct addrspace *as, struct as_segment *seg, size_t npages)
+{
+    int i = as_segment_search(as, seg->vbase);
+    assert(i >= 0 && array_getguy(as->as_segments, i) == seg);
+    if (i + 1 < array_getnum(as->as_segments)) {
+        struct as_segment *next = array_getguy(as->as_segments, i + 1);
+        if (seg->vbase + npages * PAGE_SIZE > next->vbase) {
+            return ENOMEM;
+        }
+    }
+    seg->npages = npages;
+    return 0;
+}
+
+// Add an anonymous read/write segment, its pages start out zeroed and go to swap when evicted
+static
+int
+as_define_anon(struct addrspace *as, vaddr_t vaddr, size_t npages, struct as_segment **ret)
+{
+    struct as_segment *seg = kmem_cache_alloc(as_segment_cache);
+    if (seg == NULL) {
+        return ENOMEM;
+    }
+    seg->vbase = vaddr;
+    seg->npages = npages;
+    seg->permission = 6; // Read and Write
+    seg->vnode = NULL;
+    seg->flags = 0;
+
+    int err = as_segment_insert(as, seg);
+    if (err) {
+        kmem_cache_free(as_segment_cache, seg);
+        return err;
+    }
+    if (ret != NULL) {
+        *ret = seg;
+    }
+    return 0;
+}
+
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
          int readable, int writeable, int executable)
@@ -119,8 +421,11 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
     sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
 
     npages = sz / PAGE_SIZE;
+    if (npages == 0) {
+        return 0; // Nothing to map
+    }
 
-    struct as_segment * seg = kmalloc(sizeof(struct as_segment));
+    struct as_segment * seg = kmem_cache_alloc(as_segment_cache);
     if (seg == NULL) {
         return ENOMEM;
     }
@@ -129,20 +434,167 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
     seg->vbase = vaddr;
     seg->npages = npages;
     seg->permission = (readable | writeable | executable);
+    seg->vnode = NULL; // Until load_elf_on_demand gives it a file to page from
+    seg->flags = 0;
 
     // Insert the segment into array
-    int err = array_add(as->as_segments, seg);
+    int err = as_segment_insert(as, seg);
     if (err) {
-        kfree(seg);
+        kmem_cache_free(as_segment_cache, seg);
         return err;
     }
+    return 0;
+}
 
-    // Setup heap
-    as->as_heapbase = vaddr + npages * PAGE_SIZE;
-    as->as_heapsize = 0;
+int
+as_define_mapping(struct addrspace *as, struct vnode *v, off_t offset, size_t len,
+         unsigned int permission, int shared, vaddr_t *ret)
+{
+    struct stat st;
+    size_t npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+    int err;
+
+    assert(lock_do_i_hold(as->as_lock));
+    assert(npages > 0 && (offset & ~PAGE_FRAME) == 0);
+
+    // Highest gap below the stack that fits, leaving the heap all the room sbrk may give it
+    vaddr_t end = USERSTACK;
+    vaddr_t vbase = 0;
+    int i;
+    for (i = array_getnum(as->as_segments) - 1; i >= 0; i--) {
+        struct as_segment *seg = array_getguy(as->as_segments, i);
+        vaddr_t top = (seg == as->as_heap) ? seg->vbase + HEAPPAGES * PAGE_SIZE : seg->vbase + seg->npages * PAGE_SIZE;
+        if (top <= end && end - top >= npages * PAGE_SIZE) {
+            vbase = end - npages * PAGE_SIZE;
+            break;
+        }
+        if (seg->vbase < end) {
+            end = seg->vbase;
+        }
+    }
+    if (vbase == 0) {
+        return ENOMEM;
+    }
+
+    err = VOP_STAT(v, &st);
+    if (err) {
+        return err;
+    }
+
+    struct as_segment *seg = kmem_cache_alloc(as_segment_cache);
+    if (seg == NULL) {
+        return ENOMEM;
+    }
+    seg->vbase = vbase;
+    seg->npages = npages;
+    seg->permission = permission;
+    seg->vnode = v;
+    seg->flags = AS_SEG_MMAP | (shared ? AS_SEG_SHARED : 0);
+
+    // Same layout load_elf_on_demand uses, the part of the mapping past end of file reads as zeroes
+    seg->uio.uio_iovec.iov_ubase = (userptr_t)vbase;
+    seg->uio.uio_iovec.iov_len = npages * PAGE_SIZE;
+    seg->uio.uio_resid = 0;
+    if (st.st_size > offset) {
+        seg->uio.uio_resid = (st.st_size - offset > (off_t)(npages * PAGE_SIZE)) ? npages * PAGE_SIZE : (size_t)(st.st_size - offset);
+    }
+    seg->uio.uio_offset = offset;
+    seg->uio.uio_segflg = UIO_USERSPACE;
+    seg->uio.uio_rw = UIO_READ;
+    seg->uio.uio_space = as;
+
+    err = as_segment_insert(as, seg);
+    if (err) {
+        kmem_cache_free(as_segment_cache, seg);
+        return err;
+    }
+    VOP_INCREF(v);
+    *ret = vbase;
     return 0;
 }
 
+int
+as_unmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+    vaddr_t end = vaddr + ((len + PAGE_SIZE - 1) & PAGE_FRAME);
+    int err = 0;
+    int i;
+
+    assert(lock_do_i_hold(as->as_lock));
+    if ((vaddr & ~PAGE_FRAME) != 0 || end <= vaddr || end > USERTOP) {
+        return EINVAL;
+    }
+
+    // First segment that reaches into the range
+    int first = as_segment_search(as, vaddr);
+    if (first < 0) {
+        first = 0;
+    } else {
+        struct as_segment *seg = array_getguy(as->as_segments, first);
+        if (seg->vbase + seg->npages * PAGE_SIZE <= vaddr) {
+            first++;
+        }
+    }
+
+    // Only whole mappings can go, anything else in the range is an error
+    for (i = first; i < array_getnum(as->as_segments); i++) {
+        struct as_segment *seg = array_getguy(as->as_segments, i);
+        if (seg->vbase >= end) {
+            break;
+        }
+        if (!(seg->flags & AS_SEG_MMAP) || seg->vbase < vaddr || seg->vbase + seg->npages * PAGE_SIZE > end) {
+            return EINVAL;
+        }
+    }
+
+    while (first < array_getnum(as->as_segments)) {
+        struct as_segment *seg = array_getguy(as->as_segments, first);
+        if (seg->vbase >= end) {
+            break;
+        }
+        if (seg->flags & AS_SEG_SHARED) {
+            int result = vm_sync_segment(as, seg);
+            if (result) {
+                err = result;
+            }
+        }
+        unsigned int p;
+        for (p = 0; p < seg->npages; p++) {
+            vaddr_t va = seg->vbase + p * PAGE_SIZE;
+            struct page_table_entry *e = as_pte_lookup(as, va);
+            if (e != NULL) {
+                as_free_pte(e);
+                as_tlb_unload(as, va);
+            }
+        }
+        array_remove(as->as_segments, first);
+        as_segment_free(seg);
+    }
+    return err;
+}
+
+int
+as_sync(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+    int err = 0;
+    int i;
+
+    assert(lock_do_i_hold(as->as_lock));
+    for (i = 0; i < array_getnum(as->as_segments); i++) {
+        struct as_segment *seg = array_getguy(as->as_segments, i);
+        if (!(seg->flags & AS_SEG_SHARED)) {
+            continue;
+        }
+        if (seg->vbase - vaddr < len || vaddr - seg->vbase < seg->npages * PAGE_SIZE) { // Overlaps the range
+            int result = vm_sync_segment(as, seg);
+            if (result) {
+                err = result;
+            }
+        }
+    }
+    return err;
+}
+
 int
 as_prepare_load(struct addrspace *as)
 {
@@ -160,7 +612,25 @@ as_complete_load(struct addrspace *as)
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-    (void)as;
+    // The heap starts empty right above the highest segment loaded so far
+    vaddr_t heapbase = 0;
+    int num = array_getnum(as->as_segments);
+    if (num > 0) {
+        struct as_segment *last = array_getguy(as->as_segments, num - 1);
+        heapbase = last->vbase + last->npages * PAGE_SIZE;
+    }
+
+    int err = as_define_anon(as, USERSTACK - STACKPAGES * PAGE_SIZE, STACKPAGES, NULL);
+    if (err) {
+        return err;
+    }
+    err = as_define_anon(as, heapbase, 0, &as->as_heap);
+    if (err) {
+        return err;
+    }
+    as->as_heapbase = heapbase;
+    as->as_heapsize = 0;
+
     *stackptr = USERSTACK;
     return 0;
 }
@@ -182,6 +652,7 @@ as_copy(struct addrspace *old, struct addrspace **ret)
         splx(spl);
         return ENOMEM;
     }
+    new->as_rss_limit = old->as_rss_limit; // Inherited like any other limit
 
     int i;
     // Deep copy segments info
@@ -192,85 +663,108 @@ as_copy(struct addrspace *old, struct addrspace **ret)
         return err;
     }
     for (i = 0; i < old_size; i++) {
-        struct as_segment *new_seg = kmalloc(sizeof(struct as_segment));
+        struct as_segment *new_seg = kmem_cache_alloc(as_segment_cache);
         if (new_seg == NULL) {
             splx(spl);
             return ENOMEM;
         }
         struct as_segment *old_seg = array_getguy(old->as_segments, i);
         *new_seg = *old_seg; // Copy
-        assert(array_add(new->as_segments, new_seg) == 0);
+        if (new_seg->flags & AS_SEG_MMAP) {
+            VOP_INCREF(new_seg->vnode);
+        }
+        assert(array_add(new->as_segments, new_seg) == 0); // Same order, still sorted
+        if (old_seg == old->as_heap) {
+            new->as_heap = new_seg;
+        }
     }
     new->as_heapbase = old->as_heapbase;
     new->as_heapsize = old->as_heapsize;
 
     // Deep copy page table
-    old_size = array_getnum(old->page_table);
-    err = array_preallocate(new->page_table, array_getmax(old->page_table)); // We pre-allocate so future array_add will not fail
-    if (err) {
-        splx(spl);
-        return err;
-    }
-    for (i = 0; i < old_size; i++) {
-        struct page_table_entry *new_pte = kmalloc(sizeof(struct page_table_entry));
-        if (new_pte == NULL) {
+    // Pages being paged out meanwhile are fine to share, the page-out moves every pte on the reverse map to swap
+    lock_acquire(old->as_lock);
+    unsigned int l1, l2;
+    for (l1 = 0; l1 < PT_L1_ENTRIES; l1++) {
+        struct page_table_entry *old_table = old->page_dir[l1];
+        if (old_table == NULL) {
+            continue;
+        }
+        struct page_table_entry *new_table = kmalloc(PT_L2_ENTRIES * sizeof(struct page_table_entry));
+        if (new_table == NULL) {
+            lock_release(old->as_lock);
+            as_destroy(new); // Drops the references already taken on shared pages
             splx(spl);
             return ENOMEM;
         }
-        struct page_table_entry *old_pte = array_getguy(old->page_table, i);
-        *new_pte = *old_pte; // Copy
-
-        // Now we consider if the page we are trying to share is in memory or not
-        // If it is in memory then we do normal copy-on-write
-        // If it is in swap we just allocate a new page here forget about copy-on-write
-
-        int32_t ehi, elo;
-        if (!old_pte->swapped) {
-            // Copy-On-Write implementation
-            // 1. We increase the reference count for all the pages
-            // 2. Change cow bit to 1, so later tlb update will still maintain cow
-            // 3. We set all the pages we copied to be readonly (now write -> page fault)
-
-            // Make coremap entry also a pointer to the new_pte
-            coremap[old_pte->pframe].ptes[coremap[old_pte->pframe].ref_count] = new_pte;
-
-            coremap_inc_page_ref_count(old_pte->pframe << PAGE_SHIFT);
-
-            old_pte->cow = 1;
-            new_pte->cow = 1;
-
-            ehi = old_pte->vframe << PAGE_SHIFT;
-
-            int tlb_index = TLB_Probe(ehi, 0); // eho not used pass 0
-            if (tlb_index >= 0) { // That means we found the corresponding entry in TLB
-                TLB_Read(&ehi, &elo, tlb_index);
-                // Make sure the entry we are chaning is valid
-                // The entry can be not dirty already when you forked once already
-                assert(elo & TLBLO_VALID);
-                elo &= ~TLBLO_DIRTY; // Make all page only accessable for reading
-                TLB_Write(ehi, elo, tlb_index);
+        bzero(new_table, PT_L2_ENTRIES * sizeof(struct page_table_entry));
+        new->page_dir[l1] = new_table;
+
+        for (l2 = 0; l2 < PT_L2_ENTRIES; l2++) {
+            struct page_table_entry *old_pte = &old_table[l2];
+            if (!old_pte->valid) {
+                continue;
             }
-        } else {
-            assert(0);
-            if (coremap_get_avail_page_count() == 0) { // Now we need to evict
-                err = swap_evict();
-                if (err) {
-                    return err;
+            struct page_table_entry *new_pte = &new_table[l2];
+            *new_pte = *old_pte; // Copy
+
+            // Now we consider if the page we are trying to share is in memory or not
+            // If it is in memory then we do normal copy-on-write
+            // If it is in swap we share the swap page, which is copy-on-write by nature
+
+            u_int32_t ehi, elo;
+            struct as_segment *seg = as_segment_lookup(old, old_pte->vframe << PAGE_SHIFT);
+            if (seg != NULL && (seg->flags & AS_SEG_SHARED)) {
+                // Shared mappings stay shared, both sides write to the same frame
+                assert(!old_pte->swapped);
+                if (coremap_page_share(old_pte->pframe << PAGE_SHIFT, new, new_pte)) {
+                    goto fail_share;
                 }
+            } else if (!old_pte->swapped) {
+                // Copy-On-Write implementation
+                // 1. We increase the reference count for all the pages
+                // 2. Change cow bit to 1, so later tlb update will still maintain cow
+                // 3. We set all the pages we copied to be readonly (now write -> page fault)
+
+                // Add the new pte to the page's reverse map, this also increases the reference count
+                if (coremap_page_share(old_pte->pframe << PAGE_SHIFT, new, new_pte)) {
+                    goto fail_share;
+                }
+
+                old_pte->cow = 1;
+                new_pte->cow = 1;
+
+                // Entries are tagged, if our generation is gone the TLB was flushed since
+                int tlb_index = -1;
+                if (as_asid_current(old)) {
+                    ehi = as_tlbhi(old, old_pte->vframe << PAGE_SHIFT);
+                    tlb_index = TLB_Probe(ehi, 0); // eho not used pass 0
+                }
+                if (tlb_index >= 0) { // That means we found the corresponding entry in TLB
+                    TLB_Read(&ehi, &elo, tlb_index);
+                    // Make sure the entry we are chaning is valid
+                    // The entry can be not dirty already when you forked once already
+                    assert(elo & TLBLO_VALID);
+                    elo &= ~TLBLO_DIRTY; // Make all page only accessable for reading
+                    TLB_Write(ehi, elo, tlb_index);
+                }
+            } else {
+                // Page is in swap, both address spaces share the swap page and each gets a private frame on swap-in
+                swap_share_page(old_pte->swap_file_frame);
             }
-            paddr_t paddr = coremap_alloc_upage(new_pte);
-            new_pte->pframe = paddr >> PAGE_SHIFT;
-            new_pte->cow = 0;
-            new_pte->swapped = 0;
-            new_pte->swap_file_frame = -1;
-
-            // Swapping in without freeing the page in pagefile
-            swap_load_page_without_free(paddr, old_pte->swap_file_frame, new_pte);
         }
-        assert(array_add(new->page_table, new_pte) == 0);
     }
+    lock_release(old->as_lock);
 
     *ret = new;
     splx(spl);
     return 0;
+
+fail_share:
+    // Out of rmap nodes, the pte holds no reference so it must not be freed with the rest
+    new->page_dir[l1][l2].valid = 0;
+    lock_release(old->as_lock);
+    as_destroy(new);
+    splx(spl);
+    return ENOMEM;
 }
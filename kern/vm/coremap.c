@@ -1,8 +1,10 @@
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <synch.h>
 #include <coremap.h>
 #include <swap.h>
+#include <pageout.h>
 #include <thread.h>
 #include <curthread.h>
 #include <machine/spl.h>
@@ -11,11 +13,300 @@
 struct coremap_entry *coremap = NULL;
 unsigned int page_count = 0;
 
+// Clock hand for page replacement, always points to the next page to be looked at
+static unsigned int clock_hand = 0;
+
+// Read-ahead counters
+static unsigned int prefetch_pages = 0;
+static unsigned int prefetch_hits = 0;
+static unsigned int prefetch_misses = 0;
+
+// One rmap node per mapped user page, they come from a cache of their own
+static struct kmem_cache *rmap_cache;
+
+// Working sets are sampled by the clock, a window is one full turn of the hand
+// Referenced pages it passes are credited to the address spaces mapping them
+static unsigned int clock_sweeps = 0;
+static unsigned int as_count = 0; // Live address spaces, memory is shared out between them
+static unsigned int user_page_count = 0; // Pages left for user pages and the kernel heap after boot
+static unsigned int ws_trims = 0; // Referenced pages evicted because an owner was over its share
+
+// Number of pages with the busy bit set, faults that find nothing to evict wait for one of them
+static unsigned int busy_count = 0;
+
+// Serializes multi-page allocations, they sleep while evicting user pages out of the way
+static struct lock *coremap_lock;
+
+// Kernel zone, the top of memory is set aside for multi-page kernel allocations and managed by a buddy allocator
+// Free blocks are kept on one list per order, threaded through free_next/free_prev of their first page,
+// which also has block_page_count set to the block size while the block is free
+#define ZONE_SHARE 8 // The zone gets about 1/ZONE_SHARE of free memory, rounded down to a power of 2
+#define ZONE_MAX_ORDER 14 // block_page_count is 14 bits wide
+static unsigned int zone_base = 0;
+static unsigned int zone_order = 0; // The zone is a single block of this order
+static unsigned int zone_pages = 0; // 0 if memory is too small for a zone
+static int zone_free_head[ZONE_MAX_ORDER];
+static unsigned int zone_free_blocks[ZONE_MAX_ORDER];
+static unsigned int zone_allocs = 0; // Multi-page allocations served from the zone
+static unsigned int zone_fallbacks = 0; // Multi-page allocations that didn't fit in the zone
+
+// Doubly linked lists of free pages threaded through the coremap, so allocation and free are O(1)
+// Pages the idle thread already zeroed go on a list of their own, both lists are indexed by the zeroed bit
+static int free_head[2] = { -1, -1 };
+static int free_tail[2] = { -1, -1 };
+static unsigned int free_count = 0; // Pages on both lists
+static unsigned int zero_count = 0; // Pages on the zeroed list
+
+// Frame that stays all zeroes, untouched stack and heap pages map it copy-on-write until their first write
+static unsigned int zero_frame;
+
+// Pages of shared file mappings hashed by file and offset, so every mapping of a file page uses the same frame
+#define FILE_HASH_SIZE 64
+#define FILE_HASH(v, offset) (((unsigned int)(v) / sizeof(void *) + (unsigned int)(offset) / PAGE_SIZE) % FILE_HASH_SIZE)
+static int file_hash[FILE_HASH_SIZE];
+
+// Zero pool counters
+static unsigned int zero_idle_pages = 0; // Pages zeroed by the idle thread
+static unsigned int zero_hits = 0; // Demand-zero allocations served from the pool
+static unsigned int zero_misses = 0; // Demand-zero allocations that had to zero the page on the fault path
+
+// Put a page at the head of the free page list it belongs to
+static
+void
+freelist_add(unsigned int pframe, unsigned int zeroed)
+{
+    coremap[pframe].zeroed = zeroed;
+    coremap[pframe].free_prev = -1;
+    coremap[pframe].free_next = free_head[zeroed];
+    if (free_head[zeroed] >= 0) {
+        coremap[free_head[zeroed]].free_prev = pframe;
+    } else {
+        free_tail[zeroed] = pframe;
+    }
+    free_head[zeroed] = pframe;
+    free_count++;
+    if (zeroed) {
+        zero_count++;
+    }
+}
+
+// Take a page out of its free page list, the zeroed bit is left for the caller to look at
+static
+void
+freelist_remove(unsigned int pframe)
+{
+    unsigned int zeroed = coremap[pframe].zeroed;
+    int prev = coremap[pframe].free_prev;
+    int next = coremap[pframe].free_next;
+    if (prev >= 0) {
+        coremap[prev].free_next = next;
+    } else {
+        assert(free_head[zeroed] == (int)pframe);
+        free_head[zeroed] = next;
+    }
+    if (next >= 0) {
+        coremap[next].free_prev = prev;
+    } else {
+        assert(free_tail[zeroed] == (int)pframe);
+        free_tail[zeroed] = prev;
+    }
+    coremap[pframe].free_next = -1;
+    coremap[pframe].free_prev = -1;
+    assert(free_count > 0);
+    free_count--;
+    if (zeroed) {
+        assert(zero_count > 0);
+        zero_count--;
+    }
+}
+
+static
+int
+zone_contains(unsigned int pframe)
+{
+    return pframe >= zone_base && pframe < zone_base + zone_pages;
+}
+
+static
+void
+zone_list_add(unsigned int block, unsigned int order)
+{
+    coremap[block].block_page_count = 1 << order;
+    coremap[block].free_prev = -1;
+    coremap[block].free_next = zone_free_head[order];
+    if (zone_free_head[order] >= 0) {
+        coremap[zone_free_head[order]].free_prev = block;
+    }
+    zone_free_head[order] = block;
+    zone_free_blocks[order]++;
+}
+
+static
+void
+zone_list_remove(unsigned int block, unsigned int order)
+{
+    int prev = coremap[block].free_prev;
+    int next = coremap[block].free_next;
+    if (prev >= 0) {
+        coremap[prev].free_next = next;
+    } else {
+        assert(zone_free_head[order] == (int)block);
+        zone_free_head[order] = next;
+    }
+    if (next >= 0) {
+        coremap[next].free_prev = prev;
+    }
+    coremap[block].free_next = -1;
+    coremap[block].free_prev = -1;
+    coremap[block].block_page_count = 0;
+    zone_free_blocks[order]--;
+}
+
+// Take a block of at least npages from the zone, returns -1 if there is none
+// Splitting is O(log n), the unused halves go back on the lists of their order
+static
+int
+zone_alloc(unsigned int npages)
+{
+    unsigned int order = 0;
+    while ((1U << order) < npages) {
+        order++;
+    }
+    if (zone_pages == 0 || order > zone_order) {
+        return -1;
+    }
+
+    unsigned int k = order;
+    while (k <= zone_order && zone_free_head[k] < 0) {
+        k++;
+    }
+    if (k > zone_order) {
+        return -1;
+    }
+    unsigned int block = zone_free_head[k];
+    zone_list_remove(block, k);
+    while (k > order) {
+        k--;
+        zone_list_add(block + (1 << k), k);
+    }
+
+    unsigned int j;
+    for (j = block; j < block + (1 << order); j++) {
+        coremap[j].status = 1;
+        coremap[j].kernel = 1;
+        coremap[j].block_page_count = 0;
+        coremap[j].ref_count = 1;
+    }
+    coremap[block].block_page_count = 1 << order;
+    zone_allocs++;
+    return block;
+}
+
+// Give a block back to the zone, merging it with its buddy for as long as the buddy is free too
+static
+void
+zone_free(unsigned int block)
+{
+    unsigned int order = 0;
+    while ((1U << order) < coremap[block].block_page_count) {
+        order++;
+    }
+    assert(coremap[block].block_page_count == (1U << order));
+
+    unsigned int j;
+    for (j = block; j < block + (1 << order); j++) {
+        assert(coremap[j].status && coremap[j].kernel);
+        coremap[j].status = 0;
+        coremap[j].kernel = 0;
+        coremap[j].block_page_count = 0;
+        coremap[j].ref_count = 0;
+    }
+
+    while (order < zone_order) {
+        unsigned int buddy = zone_base + ((block - zone_base) ^ (1 << order));
+        if (coremap[buddy].status || coremap[buddy].block_page_count != (1U << order)) {
+            break; // Buddy is used, or split into smaller free blocks
+        }
+        zone_list_remove(buddy, order);
+        if (buddy < block) {
+            block = buddy;
+        }
+        order++;
+    }
+    zone_list_add(block, order);
+}
+
+// NULL if the cache can't grow, the fault or fork that wanted it fails with ENOMEM
+static
+struct rmap *
+rmap_alloc(void)
+{
+    return kmem_cache_alloc(rmap_cache);
+}
+
+static
+void
+rmap_free(struct rmap *r)
+{
+    kmem_cache_free(rmap_cache, r);
+}
+
+// Take one pte off the page's mapping chain
+static
+void
+rmap_remove(unsigned int pframe, struct page_table_entry *pte)
+{
+    struct rmap **link = &coremap[pframe].rmap;
+    while (*link != NULL) {
+        struct rmap *r = *link;
+        if (r->pte == pte) {
+            *link = r->next;
+            r->as->as_rss--;
+            rmap_free(r);
+            return;
+        }
+        link = &r->next;
+    }
+    panic("coremap: pte not mapped to page %u\n", pframe);
+}
+
+// The page no longer holds its file page, it's being freed
+static
+void
+file_hash_remove(unsigned int pframe)
+{
+    if (coremap[pframe].file_vnode == NULL) {
+        return;
+    }
+    int *link = &file_hash[FILE_HASH(coremap[pframe].file_vnode, coremap[pframe].file_offset)];
+    while (*link != (int)pframe) {
+        assert(*link >= 0);
+        link = &coremap[*link].file_next;
+    }
+    *link = coremap[pframe].file_next;
+    coremap[pframe].file_vnode = NULL;
+}
+
+// Pages every address space gets if memory is split evenly
+static
+unsigned int
+coremap_fair_share(void)
+{
+    return (as_count > 0) ? user_page_count / as_count : user_page_count;
+}
+
 void
 coremap_init(void)
 {
     u_int32_t start, end;
 
+    // Has to come before ram_getsize, kmalloc can't steal memory after it
+    coremap_lock = lock_create("coremap_lock");
+    rmap_cache = kmem_cache_create("rmap", sizeof(struct rmap), NULL, NULL);
+    if (coremap_lock == NULL || rmap_cache == NULL) {
+        panic("coremap: unable to create lock or rmap cache\n");
+    }
+
     // Get the amount of physical memory
     ram_getsize(&start, &end);
 
@@ -40,15 +331,70 @@ coremap_init(void)
             coremap[i].kernel = 1; // Kernel
             coremap[i].block_page_count = 1; // The page itself
             coremap[i].ref_count = 1;
-            // coremap[i].ptes are init to zero already
+            coremap[i].referenced = 0;
+            coremap[i].file_backed = 0;
+            coremap[i].busy = 0;
+            coremap[i].prefetched = 0;
+            coremap[i].zeroed = 0;
+            coremap[i].zero_fill = 0;
+            coremap[i].file_vnode = NULL;
+            coremap[i].swap_slot = -1;
+            coremap[i].free_next = -1;
+            coremap[i].free_prev = -1;
+            coremap[i].rmap = NULL;
         } else {
             coremap[i].status = 0; // Unused
             coremap[i].kernel = 0; // Not Kernel
             coremap[i].block_page_count = 0; // Not being allocated
             coremap[i].ref_count = 0;
-            // coremap[i].ptes are init to zero already
+            coremap[i].referenced = 0;
+            coremap[i].file_backed = 0;
+            coremap[i].busy = 0;
+            coremap[i].prefetched = 0;
+            coremap[i].zeroed = 0;
+            coremap[i].zero_fill = 0;
+            coremap[i].file_vnode = NULL;
+            coremap[i].swap_slot = -1;
+            coremap[i].rmap = NULL;
         }
     }
+
+    for (i = 0; i < FILE_HASH_SIZE; i++) {
+        file_hash[i] = -1;
+    }
+
+    // Carve the kernel zone out of the top of memory
+    unsigned int share = (page_count - start/PAGE_SIZE) / ZONE_SHARE;
+    for (i = 0; i < ZONE_MAX_ORDER; i++) {
+        zone_free_head[i] = -1;
+        zone_free_blocks[i] = 0;
+    }
+    if (share >= 2) {
+        while ((2U << zone_order) <= share && zone_order + 1 < ZONE_MAX_ORDER) {
+            zone_order++;
+        }
+        zone_pages = 1 << zone_order;
+        zone_base = page_count - zone_pages;
+        zone_list_add(zone_base, zone_order);
+    } else {
+        zone_base = page_count;
+    }
+    kprintf("***Kernel zone: %d pages\n", zone_pages);
+    user_page_count = zone_base - start/PAGE_SIZE;
+
+    // Build the free page list backwards so low pages are handed out first
+    for (i = zone_base; i > start/PAGE_SIZE; i--) {
+        freelist_add(i - 1, 0);
+    }
+
+    // The shared zero page is a kernel page, so it is never evicted, and ptes mapping it don't count as references
+    zero_frame = free_head[0];
+    freelist_remove(zero_frame);
+    coremap[zero_frame].status = 1;
+    coremap[zero_frame].kernel = 1;
+    coremap[zero_frame].block_page_count = 1;
+    coremap[zero_frame].ref_count = 1;
+    bzero((void *)PADDR_TO_KVADDR(zero_frame << PAGE_SHIFT), PAGE_SIZE);
 }
 
 int
@@ -65,6 +411,8 @@ coremap_stats(int nargs, char **arg)
             a = 'K';
         } else if (coremap[i].status) {
             a = 'X';
+        } else if (zone_contains(i)) {
+            a = 'z'; // Free, but only for multi-page kernel allocations
         } else {
             a = '_';
         }
@@ -76,6 +424,35 @@ coremap_stats(int nargs, char **arg)
         }
     }
     kprintf("\n");
+
+    // Fragmentation, the largest run of free pages is the biggest block we could hand out without evicting
+    unsigned int runs = 0, run = 0, largest = 0;
+    for (i = 0; i < zone_base; i++) {
+        if (coremap[i].status) {
+            run = 0;
+            continue;
+        }
+        if (run == 0) {
+            runs++;
+        }
+        run++;
+        if (run > largest) {
+            largest = run;
+        }
+    }
+    kprintf("Free pages: %u in %u runs, largest run %u", free_count, runs, largest);
+    if (free_count > 0) {
+        kprintf(" (%u%% fragmented)", 100 - largest * 100 / free_count);
+    }
+    kprintf("\n");
+    kprintf("Kernel zone: %u pages at %u, free blocks by order:", zone_pages, zone_base);
+    for (i = 0; i <= zone_order && zone_pages > 0; i++) {
+        kprintf(" %u", zone_free_blocks[i]);
+    }
+    kprintf("\n");
+    kprintf("Kernel zone: %u allocations, %u fell back to the general pool\n", zone_allocs, zone_fallbacks);
+    kprintf("Working sets: %u address spaces, %u pages each, %u clock sweeps, %u trimmed\n",
+            as_count, coremap_fair_share(), clock_sweeps, ws_trims);
     splx(spl);
     return 0;
 }
@@ -84,32 +461,60 @@ unsigned int
 coremap_get_avail_page_count(void)
 {
     assert(curspl>0); // Make sure interrupt is disabled
-    unsigned int i;
-    unsigned int count = 0;
-    for (i = 0; i < page_count; i++) {
-        if (!coremap[i].status) {
-            count++;
-        }
+    return free_count;
+}
+
+unsigned int
+coremap_get_page_count(void)
+{
+    return page_count;
+}
+
+// Give back the pages from FIRST up to END claimed by coremap_alloc_pages before it had to give up on the run
+static
+void
+coremap_release_run(unsigned int first, unsigned int end)
+{
+    unsigned int j;
+    for (j = first; j < end; j++) {
+        coremap[j].status = 0;
+        coremap[j].kernel = 0;
+        coremap[j].ref_count = 0;
+        freelist_add(j, 0);
     }
-    return count;
 }
 
 paddr_t
 coremap_alloc_pages(int npages, unsigned int kernel_or_user, struct page_table_entry *pte)
 {
-    lock_acquire(swap_lock);
     assert(curspl>0); // Make sure interrupt is disabled
     (void)pte; // pte won't be used because we know this is for kernel
 
+    // A single page can come from anywhere, no need to look for a run
+    if (npages == 1) {
+        return coremap_alloc_page(kernel_or_user, NULL, NULL, 0);
+    }
+
+    // Most multi-page allocations fit in the kernel zone, which never holds user pages
+    int block = zone_alloc(npages);
+    if (block >= 0) {
+        return block << PAGE_SHIFT;
+    }
+    zone_fallbacks++;
+
+    lock_acquire(coremap_lock);
+
     // Here we need to look at which physical memory page is available
     // 1. Do we even have n pages available?
     // 2. Are they continous?
     // 3. Now we need to swap out pages to get all the pages continous
     // Note: because we only allocate multiple page for kernel, we want to try to make them together(not really that necessary)
 
+    // Zone pages are never on the free list, so runs have to end below it
     unsigned int i, j;
     int count = 0;
-    for (i = 0; i < page_count; i++) {
+search:
+    for (i = 0; i + npages <= zone_base; i++) {
         if (!coremap[i].status) { // Try to used unused pages first
             // Now check if we have npages of continous page
             count = 0;
@@ -125,7 +530,7 @@ coremap_alloc_pages(int npages, unsigned int kernel_or_user, struct page_table_e
         }
     }
     count = 0;
-    for (i = 0; i < page_count; i++) {
+    for (i = 0; i + npages <= zone_base; i++) {
         if (!coremap[i].kernel && (coremap[i].ref_count == 1)) { // Found an non-kernel page since we can't move kernel pages
             // Now check if we have npages of continous page
             count = 0;
@@ -140,50 +545,103 @@ coremap_alloc_pages(int npages, unsigned int kernel_or_user, struct page_table_e
             }
         }
     }
-    coremap_stats(0, NULL);
-    panic("coremap_alloc_pages failed: too many kernel pages already\n"); // We are done
+    lock_release(coremap_lock);
+    return 0; // Too many kernel pages already, no run can be made free
 
 found_continous_pages:
 
     // Moving page start froming i
+    // Evicting sleeps on disk, so a page we already looked at can be taken by a fault meanwhile, check again until it's free
+    // Each page is claimed as soon as it's free, but single kernel pages don't take coremap_lock,
+    // so one of the pages we haven't got to yet can still become a kernel page while we sleep
     for (j = i; j < i + npages; j++) {
-        if (coremap[j].status) { // Page being used, need to move it to an available page
-            assert(coremap[j].kernel == 0); // Must not be kernel
-            swap_evict_specific(j);
-        }
-        if (j == i) {
-            coremap[j].status = 1;
-            coremap[j].kernel = kernel_or_user;
-            coremap[j].block_page_count = npages;
-            coremap[j].ref_count = 1;
-        } else {
-            coremap[j].status = 1;
-            coremap[j].kernel = kernel_or_user;
-            coremap[j].block_page_count = 0;
-            coremap[j].ref_count = 1;
+        while (coremap[j].status) { // Page being used, need to move it to an available page
+            if (coremap[j].kernel) { // Taken for the kernel meanwhile, it won't move, look for another run
+                coremap_release_run(i, j);
+                goto search;
+            }
+            if (coremap[j].busy) { // Already on its way in or out, see where it ends up
+                coremap_page_wait(j << PAGE_SHIFT);
+            } else if (swap_evict_specific(j)) { // Out of swap
+                coremap_release_run(i, j);
+                lock_release(coremap_lock);
+                return 0;
+            }
         }
+        freelist_remove(j); // The page is free now(possibly just evicted), claim it
+        coremap[j].zeroed = 0;
+        coremap[j].status = 1;
+        coremap[j].kernel = kernel_or_user;
+        coremap[j].block_page_count = 0;
+        coremap[j].ref_count = 1;
     }
-    lock_release(swap_lock);
+    coremap[i].block_page_count = npages;
+    pageout_notify();
+    lock_release(coremap_lock);
     return (i * PAGE_SIZE);
 }
 
 paddr_t
-coremap_alloc_page(unsigned int kernel_or_user, struct page_table_entry *pte)
+coremap_alloc_page(unsigned int kernel_or_user, struct addrspace *as, struct page_table_entry *pte, unsigned int zeroed)
 {
     assert(curspl>0); // Make sure interrupt is disabled
-    int i;
-    for (i = 0; i < (int)page_count; i++) {
-        if (!coremap[i].status) { // Found an empty page
-            coremap[i].status = 1;
-            coremap[i].kernel = kernel_or_user;
-            coremap[i].block_page_count = 1;
-            coremap[i].ref_count = 1;
-            coremap[i].ptes[0] = pte; // Set the first one
-            return (i << PAGE_SHIFT);
+
+    // Get the rmap node first, growing the rmap cache can take the page we were about to hand out
+    struct rmap *r = NULL;
+    if (pte != NULL) {
+        r = rmap_alloc();
+        if (r == NULL) {
+            return 0;
         }
+        r->as = as;
+        r->pte = pte;
+        r->next = NULL;
+        as->as_rss++;
     }
-    assert(0); // We should never be here, because this function will only be called if we know we have memory
-    return (paddr_t)NULL;
+    // Our caller made room, but the rmap refill or another fault may have taken it while we slept
+    while (free_count == 0) {
+        if (swap_evict()) { // Out of memory and swap, the caller fails with ENOMEM
+            if (r != NULL) {
+                rmap_free(r);
+                as->as_rss--;
+            }
+            return 0;
+        }
+    }
+
+    // This function will only be called if we know we have memory
+    // Zeroed pages are kept for whoever needs one, everybody else takes them only when nothing else is left
+    int i = (zeroed && free_head[1] >= 0) || free_head[0] < 0 ? free_head[1] : free_head[0];
+    assert(i >= 0);
+    freelist_remove(i);
+    assert(!coremap[i].status);
+    if (zeroed) {
+        if (coremap[i].zeroed) {
+            zero_hits++;
+        } else {
+            bzero((void *)PADDR_TO_KVADDR(i << PAGE_SHIFT), PAGE_SIZE);
+            zero_misses++;
+        }
+    }
+    coremap[i].zeroed = 0;
+
+    coremap[i].status = 1;
+    coremap[i].kernel = kernel_or_user;
+    coremap[i].block_page_count = 1;
+    coremap[i].ref_count = 1;
+    coremap[i].referenced = 1; // Give new page a chance before it gets evicted
+    coremap[i].file_backed = 0;
+    coremap[i].busy = 0;
+    coremap[i].prefetched = 0;
+    coremap[i].zero_fill = 0;
+    coremap[i].file_vnode = NULL;
+    coremap[i].swap_slot = -1;
+    coremap[i].rmap = r;
+    if (pte != NULL) { // Not evictable until the pte points to it, the caller releases it
+        coremap_page_set_busy(i << PAGE_SHIFT);
+    }
+    pageout_notify();
+    return (i << PAGE_SHIFT);
 }
 
 void
@@ -197,11 +655,22 @@ coremap_free_pages(paddr_t paddr, struct page_table_entry *pte)
     // 3. Decrease ref count on the page
     // 4. If ref count is 0, than free the page otherwise don't do anything
     unsigned int pframe = paddr >> PAGE_SHIFT;
+    if (pframe == zero_frame && pte != NULL) { // Mappings of the zero page hold no reference
+        return;
+    }
+    if (zone_contains(pframe)) {
+        assert(pte == NULL);
+        zone_free(pframe);
+        return;
+    }
     // I thought the below assert was necessary, however one of the kernel page was freed by the OS
     //assert(pframe >= first_avail_page && pframe < page_count);
-    unsigned int i, j, k;
+    unsigned int i;
     unsigned int block_page_count = coremap[pframe].block_page_count;
     for (i = 0; i < block_page_count; i++) {
+        if (pte != NULL) { // User page, unmap the pte
+            rmap_remove(pframe + i, pte);
+        }
         coremap[pframe + i].ref_count -= 1;
         assert(coremap[pframe + i].ref_count >= 0);
         if (coremap[pframe + i].ref_count == 0) {
@@ -209,33 +678,46 @@ coremap_free_pages(paddr_t paddr, struct page_table_entry *pte)
             coremap[pframe + i].kernel = 0;
             coremap[pframe + i].block_page_count = 0;
             coremap[pframe + i].ref_count = 0;
-            for (j = 0; j < MAX_SHARED_PAGE; j++) {
-                coremap[pframe + i].ptes[j] = NULL;
+            coremap[pframe + i].referenced = 0;
+            coremap[pframe + i].file_backed = 0;
+            file_hash_remove(pframe + i);
+            if (coremap[pframe + i].busy) { // Never got filled
+                coremap_page_clear_busy((pframe + i) << PAGE_SHIFT);
             }
-        } else {
-            // Just remove the pte pointer
-            int flag = 0;
-            for (j = 0; j < MAX_SHARED_PAGE; j++) {
-                if (coremap[pframe + i].ptes[j] == pte) {
-                    for (k = j; k < MAX_SHARED_PAGE - 1; k++) {
-                        coremap[pframe + i].ptes[k] = coremap[pframe + i].ptes[k + 1];
-                    }
-                    flag = 1;
-                    break;
-                }
+            if (coremap[pframe + i].prefetched) { // Read ahead for nothing
+                coremap[pframe + i].prefetched = 0;
+                prefetch_misses++;
             }
-            assert(flag);
+            if (coremap[pframe + i].swap_slot >= 0) { // Nobody will swap this page back in
+                swap_free_page(coremap[pframe + i].swap_slot);
+                coremap[pframe + i].swap_slot = -1;
+            }
+            assert(coremap[pframe + i].rmap == NULL);
+            freelist_add(pframe + i, 0);
         }
     }
 }
 
-void
-coremap_inc_page_ref_count(paddr_t paddr)
+int
+coremap_page_share(paddr_t paddr, struct addrspace *as, struct page_table_entry *pte)
 {
     assert(curspl>0); // Make sure interrupt is disabled
 
     unsigned int pframe = paddr >> PAGE_SHIFT;
+    if (pframe == zero_frame) { // Mappings of the zero page hold no reference
+        return 0;
+    }
+    struct rmap *r = rmap_alloc();
+    if (r == NULL) {
+        return ENOMEM;
+    }
+    r->as = as;
+    r->pte = pte;
+    r->next = coremap[pframe].rmap;
+    coremap[pframe].rmap = r;
     coremap[pframe].ref_count += 1;
+    as->as_rss++;
+    return 0;
 }
 
 unsigned int
@@ -257,7 +739,11 @@ coremap_page_swap_in(paddr_t paddr, struct page_table_entry *pte)
     coremap[pframe].kernel = 0; // Kernel should never be swapped out in the first place
     coremap[pframe].block_page_count = 1;
     coremap[pframe].ref_count = 1; // No cow after swap
-    coremap[pframe].ptes[0] = pte;
+    coremap[pframe].referenced = 1; // Just used by the faulting process
+    coremap[pframe].file_backed = 0;
+    coremap[pframe].swap_slot = -1; // Caller decides if the slot is kept
+    // The page was allocated for this pte, so it is already the only mapping
+    assert(coremap[pframe].rmap != NULL && coremap[pframe].rmap->pte == pte && coremap[pframe].rmap->next == NULL);
 }
 
 void
@@ -270,70 +756,352 @@ coremap_page_swap_out(paddr_t paddr)
     coremap[pframe].kernel = 0; // Kernel should never be swapped out in the first place
     coremap[pframe].block_page_count = 0;
     coremap[pframe].ref_count = 0;
-    unsigned int j;
-    for (j = 0; j < MAX_SHARED_PAGE; j++) {
-        coremap[pframe].ptes[j] = NULL;
+    coremap[pframe].referenced = 0;
+    coremap[pframe].file_backed = 0;
+    coremap[pframe].zero_fill = 0;
+    file_hash_remove(pframe);
+    if (coremap[pframe].busy) { // Page-out is done, whoever waited on the page finds it in swap now
+        coremap_page_clear_busy(paddr);
+    }
+    if (coremap[pframe].prefetched) { // Read ahead for nothing
+        coremap[pframe].prefetched = 0;
+        prefetch_misses++;
     }
+    assert(coremap[pframe].swap_slot < 0); // The pte owns the slot now
+    while (coremap[pframe].rmap != NULL) {
+        struct rmap *r = coremap[pframe].rmap;
+        coremap[pframe].rmap = r->next;
+        r->as->as_rss--;
+        rmap_free(r);
+    }
+    freelist_add(pframe, 0);
+}
+
+void
+coremap_page_referenced(paddr_t paddr)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    unsigned int pframe = paddr >> PAGE_SHIFT;
+    coremap[pframe].referenced = 1;
+    if (coremap[pframe].prefetched) { // Read ahead paid off
+        coremap[pframe].prefetched = 0;
+        prefetch_hits++;
+    }
+}
+
+void
+coremap_page_prefetched(paddr_t paddr)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    unsigned int pframe = paddr >> PAGE_SHIFT;
+    coremap[pframe].prefetched = 1;
+    coremap[pframe].referenced = 0; // Nobody used it yet, first in line for the clock
+    prefetch_pages++;
+}
+
+void
+coremap_prefetch_stats(void)
+{
+    kprintf("Read-ahead: %u pages, %u hits, %u misses\n", prefetch_pages, prefetch_hits, prefetch_misses);
+}
+
+paddr_t
+coremap_zero_page(void)
+{
+    return zero_frame << PAGE_SHIFT;
 }
 
 unsigned int
-coremap_page_to_evict(void)
+coremap_get_unzeroed_page_count(void)
 {
     assert(curspl>0); // Make sure interrupt is disabled
+    return free_count - zero_count;
+}
 
-    // Right now we just return a random page TODO: Change this to be better such as aging
-    unsigned int i, count = 0;
-    for (i = 0; i < page_count; i++) {
-        if (!coremap[i].kernel && (coremap[i].ref_count == 1)) { // Have to be not a kernel page, bad things might happen
-            count++;
-        }
+int
+coremap_zero_free_page(void)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    // Oldest free page first, recently freed ones are the likeliest to be taken again right away
+    int i = free_tail[0];
+    if (i < 0) {
+        return 0;
     }
-    assert(count > 0); // We are out of memory
-    unsigned int index = random() % count;
-    count = 0;
-    for (i = 0; i < page_count; i++) {
-        if (!coremap[i].kernel && (coremap[i].ref_count == 1)) { // Have to be not a kernel page, bad things might happen
-            if (index == count) {
-                assert(coremap[i].status == 1);
-                assert(coremap[i].kernel == 0);
-                return i; // i is the page that we want to evict
-            }
-            count++;
+    freelist_remove(i);
+    bzero((void *)PADDR_TO_KVADDR(i << PAGE_SHIFT), PAGE_SIZE);
+    freelist_add(i, 1);
+    zero_idle_pages++;
+    return 1;
+}
+
+void
+coremap_zero_stats(void)
+{
+    kprintf("Zero pool: %u of %u free pages zeroed, %u zeroed while idle, %u hits, %u misses\n",
+        zero_count, free_count, zero_idle_pages, zero_hits, zero_misses);
+}
+
+void
+coremap_page_file_backed(paddr_t paddr)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    unsigned int pframe = paddr >> PAGE_SHIFT;
+    coremap[pframe].file_backed = 1;
+}
+
+void
+coremap_page_file_shared(paddr_t paddr, struct vnode *v, off_t offset)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    unsigned int pframe = paddr >> PAGE_SHIFT;
+    assert(coremap[pframe].file_vnode == NULL);
+    assert(coremap_find_file_page(v, offset) == 0);
+    coremap[pframe].file_backed = 1;
+    coremap[pframe].file_vnode = v;
+    coremap[pframe].file_offset = offset;
+    coremap[pframe].file_next = file_hash[FILE_HASH(v, offset)];
+    file_hash[FILE_HASH(v, offset)] = pframe;
+}
+
+paddr_t
+coremap_find_file_page(struct vnode *v, off_t offset)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    int i;
+    for (i = file_hash[FILE_HASH(v, offset)]; i >= 0; i = coremap[i].file_next) {
+        if (coremap[i].file_vnode == v && coremap[i].file_offset == offset) {
+            return i << PAGE_SHIFT;
         }
     }
-    assert(0); // Should not reach here
-    return -1;
+    return 0;
 }
 
-unsigned int
-coremap_page_to_evict_avoidance(unsigned int pframe)
+int
+coremap_page_begin_writeback(paddr_t paddr)
 {
     assert(curspl>0); // Make sure interrupt is disabled
 
-    // Right now we just return a random page TODO: Change this to be better such as aging
-    unsigned int i, count = 0;
-    for (i = 0; i < page_count; i++) {
-        if (!coremap[i].kernel && (i != pframe) && (coremap[i].ref_count == 1)) { // Have to be not a kernel page, bad things might happen
-            count++;
-        }
+    unsigned int pframe = paddr >> PAGE_SHIFT;
+    struct rmap *r;
+    int dirty = 0;
+    assert(coremap[pframe].file_vnode != NULL);
+    for (r = coremap[pframe].rmap; r != NULL; r = r->next) {
+        dirty |= r->pte->dirty;
     }
-    assert(count > 0); // We are out of memory
-    unsigned int index = random() % count;
-    count = 0;
-    for (i = 0; i < page_count; i++) {
-        if (!coremap[i].kernel && (i != pframe) && (coremap[i].ref_count == 1)) { // Have to be not a kernel page, bad things might happen
-            if (index == count) {
-                if (coremap[i].status != 1) {
-                    coremap_stats(0, NULL);
-                    assert(coremap[i].status == 1);
-                }
-                assert(coremap[i].kernel == 0);
-                return i; // i is the page that we want to evict
+    if (!dirty) {
+        return 0;
+    }
+    // Writes from here on fault and find the page busy, the next one dirties it again
+    coremap_page_set_busy(paddr);
+    coremap_page_unload(pframe);
+    for (r = coremap[pframe].rmap; r != NULL; r = r->next) {
+        r->pte->dirty = 0;
+    }
+    return 1;
+}
+
+void
+coremap_page_dirty(paddr_t paddr)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    unsigned int pframe = paddr >> PAGE_SHIFT;
+    coremap[pframe].zero_fill = 0;
+    if (coremap[pframe].swap_slot >= 0) {
+        swap_free_page(coremap[pframe].swap_slot);
+        coremap[pframe].swap_slot = -1;
+    }
+}
+
+void
+coremap_page_zero_fill(paddr_t paddr)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    unsigned int pframe = paddr >> PAGE_SHIFT;
+    assert(coremap[pframe].swap_slot < 0 && !coremap[pframe].file_backed);
+    coremap[pframe].zero_fill = 1;
+}
+
+// Drop the TLB entry of every mapping of a physical page, one probe per mapping
+void
+coremap_page_unload(unsigned int pframe)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    struct rmap *r;
+    for (r = coremap[pframe].rmap; r != NULL; r = r->next) {
+        as_tlb_unload(r->as, r->pte->vframe << PAGE_SHIFT);
+    }
+}
+
+int
+coremap_page_busy(paddr_t paddr)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    return coremap[paddr >> PAGE_SHIFT].busy;
+}
+
+void
+coremap_page_set_busy(paddr_t paddr)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    unsigned int pframe = paddr >> PAGE_SHIFT;
+    assert(!coremap[pframe].busy);
+    coremap[pframe].busy = 1;
+    busy_count++;
+}
+
+void
+coremap_page_clear_busy(paddr_t paddr)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    unsigned int pframe = paddr >> PAGE_SHIFT;
+    assert(coremap[pframe].busy);
+    coremap[pframe].busy = 0;
+    busy_count--;
+    thread_wakeup(&coremap[pframe]);
+    thread_wakeup(&busy_count);
+}
+
+void
+coremap_page_wait(paddr_t paddr)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    unsigned int pframe = paddr >> PAGE_SHIFT;
+    while (coremap[pframe].busy) {
+        thread_sleep(&coremap[pframe]);
+    }
+}
+
+int
+coremap_wait_busy_pages(void)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    if (busy_count == 0) {
+        return ENOMEM;
+    }
+    thread_sleep(&busy_count);
+    return 0;
+}
+
+// Bring the working set window of an address space up to the current sweep
+// The estimate is what the last full sweep saw, an address space the clock didn't credit for a whole sweep has none
+static
+void
+coremap_ws_roll(struct addrspace *as)
+{
+    if (as->as_ws_sweep != clock_sweeps) {
+        as->as_ws = (as->as_ws_sweep + 1 == clock_sweeps) ? as->as_ws_refs : 0;
+        as->as_ws_refs = 0;
+        as->as_ws_sweep = clock_sweeps;
+    }
+}
+
+// An address space is trimmed first when it is over its resident limit, holds more than its fair share
+// while others need memory, or had no page referenced for a whole sweep
+static
+int
+coremap_as_over_share(struct addrspace *as)
+{
+    coremap_ws_roll(as);
+    if (as->as_rss_limit > 0 && as->as_rss > as->as_rss_limit) {
+        return 1;
+    }
+    if (as->as_rss > coremap_fair_share()) {
+        return 1;
+    }
+    return as->as_ws == 0 && as->as_ws_refs == 0 && clock_sweeps - as->as_ws_created >= 2; // It had a whole sweep to show up
+}
+
+// Second-chance clock over the coremap
+// Referenced pages get their bit cleared and are skipped once, so we need at most two sweeps
+// Pages of an address space over its share get no second chance, so big or idle processes shrink first
+static
+unsigned int
+coremap_clock_select(void)
+{
+    unsigned int scanned;
+    for (scanned = 0; scanned < 2 * page_count; scanned++) {
+        unsigned int i = clock_hand;
+        clock_hand = (clock_hand + 1) % page_count;
+        if (clock_hand == 0) {
+            clock_sweeps++;
+        }
+
+        // Have to be not a kernel page(bad things might happen) and not in the middle of I/O or a copy
+        // Shared copy-on-write pages are fine, they go to swap as one unit
+        if (!coremap[i].status || coremap[i].kernel || coremap[i].busy) {
+            continue;
+        }
+        if (coremap[i].referenced) {
+            coremap[i].referenced = 0; // Second chance
+            coremap_page_unload(i);
+            int over = 0;
+            struct rmap *r;
+            for (r = coremap[i].rmap; r != NULL; r = r->next) {
+                coremap_ws_roll(r->as);
+                r->as->as_ws_refs++;
+                over |= coremap_as_over_share(r->as);
+            }
+            if (!over) {
+                continue;
             }
-            count++;
+            ws_trims++;
         }
+        return i; // i is the page that we want to evict
     }
-    assert(0); // Should not reach here
-    return -1;
+    return page_count; // Everything is kernel or busy, nothing we can evict
+}
+
+void
+coremap_as_register(struct addrspace *as)
+{
+    int spl = splhigh();
+    as->as_rss = 0;
+    as->as_rss_limit = 0;
+    as->as_ws = 0;
+    as->as_ws_refs = 0;
+    as->as_ws_sweep = clock_sweeps;
+    as->as_ws_created = clock_sweeps;
+    as_count++;
+    splx(spl);
+}
+
+void
+coremap_as_unregister(struct addrspace *as)
+{
+    int spl = splhigh();
+    assert(as->as_rss == 0);
+    assert(as_count > 0);
+    as_count--;
+    splx(spl);
+}
+
+unsigned int
+coremap_as_ws(struct addrspace *as)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    coremap_ws_roll(as);
+    return as->as_ws;
+}
+
+unsigned int
+coremap_page_to_evict(void)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
 
+    return coremap_clock_select();
 }
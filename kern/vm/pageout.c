@@ -0,0 +1,124 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <coremap.h>
+#include <swap.h>
+#include <vm.h>
+#include <pageout.h>
+#include <machine/spl.h>
+
+// Watermarks in free frames, both stay 0 until the daemon is running so nobody tries to wake it early
+static unsigned int pageout_low = 0;
+static unsigned int pageout_high = 0;
+
+// Statistics
+static unsigned int pageout_wakeups = 0; // Number of times the daemon went to work
+static unsigned int pageout_pages = 0; // Pages evicted by the daemon
+static unsigned int pageout_stalls = 0; // Faults that had to evict by themselves
+
+static
+void
+pageout_thread(void *unused1, unsigned long unused2)
+{
+    (void)unused1;
+    (void)unused2;
+
+    splhigh(); // Like the rest of VM, the daemon runs with interrupt disabled
+
+    while (1) {
+        while (coremap_get_avail_page_count() >= pageout_low || swap_get_avail_page_count() == 0) {
+            thread_sleep(&pageout_low);
+        }
+        pageout_wakeups++;
+
+        while (coremap_get_avail_page_count() < pageout_high) {
+            // No lock to take, victims are busy while their write is in flight and faults on them wait for it
+            unsigned int evicted;
+            unsigned int err = swap_evict_batch(pageout_high - coremap_get_avail_page_count(), &evicted);
+            if (err) { // Out of swap or nothing evictable, faults will sort it out themselves
+                // Don't go straight back to evicting, we'd spin with interrupts off and never let anyone run
+                // Wait for a page-out in flight to finish, or for the next allocation if there is none
+                if (coremap_wait_busy_pages()) {
+                    thread_sleep(&pageout_low);
+                }
+                break;
+            }
+            pageout_pages += evicted;
+            thread_yield(); // Don't hog the CPU when the disk is fast
+        }
+    }
+}
+
+void
+pageout_bootstrap(void)
+{
+    int spl = splhigh();
+    // Default to keeping 1/16th of memory free, the daemon has to be able to stay ahead of a fault loop
+    unsigned int avail = coremap_get_avail_page_count();
+    pageout_low = avail / 16;
+    if (pageout_low < 2) {
+        pageout_low = 2;
+    }
+    pageout_high = pageout_low * 2;
+    splx(spl);
+
+    int err = thread_fork("pageout", NULL, 0, pageout_thread, NULL);
+    if (err) {
+        panic("pageout: thread_fork failed: %s\n", strerror(err));
+    }
+}
+
+void
+pageout_notify(void)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    if (coremap_get_avail_page_count() < pageout_low) {
+        thread_wakeup(&pageout_low);
+    }
+}
+
+void
+pageout_stall(void)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+    pageout_stalls++;
+}
+
+unsigned int
+pageout_spare_pages(void)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    unsigned int avail = coremap_get_avail_page_count();
+    return (avail > pageout_low) ? avail - pageout_low : 0;
+}
+
+int
+pageout_stats(int nargs, char **arg)
+{
+    int spl = splhigh();
+    if (nargs == 3) {
+        unsigned int low = atoi(arg[1]);
+        unsigned int high = atoi(arg[2]);
+        if (low == 0 || high < low || high >= coremap_get_page_count()) {
+            splx(spl);
+            kprintf("Usage: pd [low high], 0 < low <= high < %u\n", coremap_get_page_count());
+            return EINVAL;
+        }
+        pageout_low = low;
+        pageout_high = high;
+        pageout_notify(); // We might be below the new low watermark already
+    } else if (nargs != 1) {
+        splx(spl);
+        kprintf("Usage: pd [low high]\n");
+        return EINVAL;
+    }
+
+    kprintf("Free pages: %u (low %u, high %u)\n", coremap_get_avail_page_count(), pageout_low, pageout_high);
+    kprintf("Pageout: %u wakeups, %u pages evicted, %u fault stalls\n", pageout_wakeups, pageout_pages, pageout_stalls);
+    splx(spl);
+    return 0;
+}
@@ -0,0 +1,50 @@
+#include <types.h>
+#include <lib.h>
+#include <thread.h>
+#include <scheduler.h>
+#include <coremap.h>
+#include <pagezero.h>
+#include <machine/spl.h>
+
+// Nonzero once the thread exists, the scheduler runs long before vm_bootstrap
+static int pagezero_started = 0;
+
+static
+void
+pagezero_thread(void *unused1, unsigned long unused2)
+{
+    (void)unused1;
+    (void)unused2;
+
+    splhigh(); // Like the rest of VM, the thread runs with interrupt disabled
+
+    while (1) {
+        thread_sleep(&pagezero_started); // Until the CPU would otherwise be idle
+
+        // One page at a time, with a window for interrupts in between so anything they wake up gets the CPU back right away
+        while (scheduler_idle() && coremap_zero_free_page()) {
+            spl0();
+            splhigh();
+        }
+    }
+}
+
+void
+pagezero_bootstrap(void)
+{
+    int err = thread_fork("pagezero", NULL, 0, pagezero_thread, NULL);
+    if (err) {
+        panic("pagezero: thread_fork failed: %s\n", strerror(err));
+    }
+    pagezero_started = 1;
+}
+
+void
+pagezero_idle(void)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    if (pagezero_started && coremap_get_unzeroed_page_count() > 0) {
+        thread_wakeup(&pagezero_started);
+    }
+}
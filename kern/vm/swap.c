@@ -18,13 +18,47 @@
 static struct vnode *swapfile;
 static unsigned int swapsize;
 static struct bitmap *swap_table;
+static u_int16_t *swap_refs; // Users of each swap page: swapped ptes, plus a frame keeping it as its clean copy
 static unsigned int swap_avail_page;
-struct lock *swap_lock;
+static unsigned int swap_writes = 0; // Evictions that had to write the page
+static unsigned int swap_cluster_writes = 0; // Batched writes, each covering up to SWAP_CLUSTER pages
+static unsigned int swap_cluster_hint = 0; // Where the next cluster search starts
+static char swap_buffer[SWAP_CLUSTER * PAGE_SIZE]; // Staging buffer for batched I/O, the frames are not physically contiguous
+static unsigned int swap_clean_drops = 0; // Evictions of clean pages that needed no I/O
+static unsigned int swap_file_writes = 0; // Evictions of shared file mapping pages that went back to their file
+
+// Protects the swap page table and counters, never held across disk I/O
+static struct lock *swap_lock;
+// Owner of swap_buffer, held across the I/O that goes through it
+static struct lock *swap_buffer_lock;
+
+// Do disk I/O on the swap file with interrupts on, other processes keep running while we wait for the disk
+// The frames involved are busy, that keeps everybody else away from them meanwhile
+static
+int
+swap_io(struct uio *u)
+{
+    int err;
+    int spl = spl0();
+    if (u->uio_rw == UIO_READ) {
+        err = VOP_READ(swapfile, u);
+    } else {
+        err = VOP_WRITE(swapfile, u);
+    }
+    splx(spl);
+    return err;
+}
 
 void
 swap_init(void)
 {
     // Interrupt doesn't need to be off here because we are boot straping
+    swap_lock = lock_create("swap_lock");
+    swap_buffer_lock = lock_create("swap_buffer_lock");
+    if (swap_lock == NULL || swap_buffer_lock == NULL) {
+        panic("Unable to create swap locks\n");
+    }
+
     char *swapfile_name = "lhd1raw:";
     int err = vfs_open(swapfile_name, O_RDWR, &swapfile);
     if (err) {
@@ -34,8 +68,12 @@ swap_init(void)
     VOP_STAT(swapfile, &stat);
     swapsize = stat.st_size / PAGE_SIZE; // Get the number of pages that can be used for swapping
     swap_table = bitmap_create(swapsize); // Use this structure to allocate and deallocate swap page
+    swap_refs = kmalloc(swapsize * sizeof(u_int16_t));
+    if (swap_table == NULL || swap_refs == NULL) {
+        panic("Unable to allocate swap table\n");
+    }
+    bzero(swap_refs, swapsize * sizeof(u_int16_t));
     swap_avail_page = swapsize;
-    swap_lock = lock_create("swap_lock");
 }
 
 unsigned int
@@ -54,36 +92,53 @@ swap_load_page(paddr_t paddr, unsigned int file_frame, struct page_table_entry *
     // Need to work within kernel space
     mk_kuio(&u, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE, file_frame << PAGE_SHIFT, UIO_READ);
 
-    if (VOP_READ(swapfile, &u)) {
+    if (swap_io(&u)) {
         panic("swap_load_page failed\n");
     }
 
     // Update coremap here to reflect the change
     coremap_page_swap_in(paddr, pte);
 
-    // Update pte to reflect the swapin
+    // Update pte to reflect the swapin(pframe shares storage with swap_file_frame)
+    // The frame is private even if other ptes still share the swap page
     pte->swapped = 0;
-    pte->swap_file_frame = -1;
+    pte->cow = 0;
+    pte->pframe = paddr >> PAGE_SHIFT;
 
-    // Free the swap page
-    swap_free_page(file_frame);
+    // Keep the swap page until the first write, a clean page can then be evicted without writing it again
+    pte->dirty = 0;
+    coremap[paddr >> PAGE_SHIFT].swap_slot = file_frame;
 }
 
 void
-swap_load_page_without_free(paddr_t paddr, unsigned int file_frame, struct page_table_entry *pte)
+swap_load_pages(unsigned int file_frame, unsigned int npages, paddr_t *paddrs, struct page_table_entry **ptes)
 {
     assert(curspl>0); // Make sure interrupt is disabled
+    assert(npages <= SWAP_CLUSTER);
 
     struct uio u;
-    // Need to work within kernel space
-    mk_kuio(&u, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE, file_frame << PAGE_SHIFT, UIO_READ);
+    // One request for the whole run, the frames are not contiguous so go through the staging buffer
+    lock_acquire(swap_buffer_lock);
+    mk_kuio(&u, swap_buffer, npages * PAGE_SIZE, file_frame << PAGE_SHIFT, UIO_READ);
 
-    if (VOP_READ(swapfile, &u)) {
-        panic("swap_load_page failed\n");
+    if (swap_io(&u)) {
+        panic("swap_load_pages failed\n");
     }
 
-    // Update coremap here to reflect the change
-    coremap_page_swap_in(paddr, pte);
+    unsigned int i;
+    for (i = 0; i < npages; i++) {
+        memmove((void *)PADDR_TO_KVADDR(paddrs[i]), swap_buffer + i * PAGE_SIZE, PAGE_SIZE);
+    }
+    lock_release(swap_buffer_lock);
+
+    for (i = 0; i < npages; i++) {
+        coremap_page_swap_in(paddrs[i], ptes[i]);
+        ptes[i]->swapped = 0;
+        ptes[i]->cow = 0;
+        ptes[i]->pframe = paddrs[i] >> PAGE_SHIFT;
+        ptes[i]->dirty = 0;
+        coremap[paddrs[i] >> PAGE_SHIFT].swap_slot = file_frame + i;
+    }
 }
 
 void
@@ -91,17 +146,16 @@ swap_store_page(paddr_t paddr, unsigned int file_frame)
 {
     assert(curspl>0); // Make sure interrupt is disabled
 
+    // Only the victim's mappings go, before the write so nobody can dirty the page behind our back
+    coremap_page_unload(paddr >> PAGE_SHIFT);
+
     struct uio u;
     // Need to work within kernel space
     mk_kuio(&u, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE, file_frame << PAGE_SHIFT, UIO_WRITE);
 
-    if (VOP_WRITE(swapfile, &u)) {
+    if (swap_io(&u)) {
         panic("swap_store_page failed\n");
     }
-
-    // Update coremap here to reflect the change
-    //coremap_page_swap_out(paddr);
-    TLB_Flush();
 }
 
 unsigned int
@@ -109,113 +163,270 @@ swap_alloc_page(void)
 {
     assert(curspl>0); // Make sure interrupt is disabled
     unsigned int temp;
+    lock_acquire(swap_lock);
     bitmap_alloc(swap_table, &temp);
     swap_avail_page--;
     assert(temp < swapsize);
+    swap_refs[temp] = 1;
+    lock_release(swap_lock);
     return temp;
 }
 
 void
-swap_free_page(unsigned int file_frame)
+swap_share_page(unsigned int file_frame)
 {
     assert(curspl>0); // Make sure interrupt is disabled
-    assert(bitmap_isset(swap_table, file_frame)); // This should always be true
-    bitmap_unmark(swap_table, file_frame);
-    swap_avail_page++;
+    lock_acquire(swap_lock);
+    assert(bitmap_isset(swap_table, file_frame));
+    assert(swap_refs[file_frame] < 0xffff);
+    swap_refs[file_frame]++;
+    lock_release(swap_lock);
 }
 
-unsigned int
-swap_evict(void)
+void
+swap_free_page(unsigned int file_frame)
 {
     assert(curspl>0); // Make sure interrupt is disabled
+    lock_acquire(swap_lock);
+    assert(bitmap_isset(swap_table, file_frame)); // This should always be true
+    assert(swap_refs[file_frame] > 0);
+    swap_refs[file_frame]--;
+    if (swap_refs[file_frame] == 0) { // Last user is gone
+        bitmap_unmark(swap_table, file_frame);
+        swap_avail_page++;
+    }
+    lock_release(swap_lock);
+}
 
-    if (swap_avail_page == 0) { // We are out of swap -> out of memory
-        return ENOMEM;
+// A shared frame only counts as clean if none of its ptes wrote to it
+static
+int
+swap_frame_dirty(unsigned int pframe)
+{
+    struct rmap *r;
+    for (r = coremap[pframe].rmap; r != NULL; r = r->next) {
+        if (r->pte->dirty) {
+            return 1;
+        }
     }
+    return 0;
+}
 
-    // Figure out which page to be removed from memory
-    unsigned int pframe = coremap_page_to_evict();
+// Point every pte of the frame to the swap page and release the frame
+// The caller holds one reference on the swap page, every other sharer gets its own
+static
+void
+swap_unmap_frame(unsigned int pframe, unsigned int file_frame)
+{
+    struct rmap *r;
+    for (r = coremap[pframe].rmap; r != NULL; r = r->next) {
+        struct page_table_entry *e = r->pte;
+        if (r != coremap[pframe].rmap) {
+            swap_share_page(file_frame);
+        }
+        e->cow = 0; // Each sharer gets a private copy on swap-in
+        e->swapped = 1;
+        e->swap_file_frame = file_frame;
+    }
+    coremap_page_swap_out(pframe << PAGE_SHIFT);
+}
 
-    // Update all the ptes because when swaping out page, we can't have shared pages anymore
-    unsigned int i;
-    for (i = 0; i < coremap[pframe].ref_count; i++) {
-        assert(i == 0); // Not testing i > 0 yet
+// Remove a page from memory, only clean pages that can be read back from somewhere skip the disk
+// Shared copy-on-write pages go out as one unit, all the sharers end up on the same swap page
+// A page that needs writing is busy until the write is done, faults on it wait and then find it in swap
+static
+unsigned int
+swap_evict_frame(unsigned int pframe)
+{
+    struct rmap *r;
+
+    assert(!coremap[pframe].busy);
+
+    if (!swap_frame_dirty(pframe) && coremap[pframe].swap_slot >= 0) {
+        // Swap still has the same content, the frame's reference on the slot goes to the first pte
+        unsigned int file_frame = coremap[pframe].swap_slot;
+        coremap[pframe].swap_slot = -1;
+        coremap_page_unload(pframe);
+        swap_unmap_frame(pframe, file_frame);
+        swap_clean_drops++;
+    } else if (!swap_frame_dirty(pframe) && coremap[pframe].zero_fill) {
+        // Prefaulted page nobody wrote to, it still reads as zeroes, so map the zero page again instead of swapping
+        coremap_page_unload(pframe);
+        for (r = coremap[pframe].rmap; r != NULL; r = r->next) {
+            r->pte->pframe = coremap_zero_page() >> PAGE_SHIFT;
+            r->pte->cow = 1;
+        }
+        coremap_page_swap_out(pframe << PAGE_SHIFT);
+        swap_clean_drops++;
+    } else if (!swap_frame_dirty(pframe) && coremap[pframe].file_backed) {
+        // Untouched executable page, the next fault reads it from the ELF file again
+        coremap_page_unload(pframe);
+        for (r = coremap[pframe].rmap; r != NULL; r = r->next) {
+            r->pte->valid = 0;
+        }
+        coremap_page_swap_out(pframe << PAGE_SHIFT);
+        swap_clean_drops++;
+    } else if (coremap[pframe].file_vnode != NULL) {
+        // Written page of a shared file mapping, it goes back to the file and the next fault reads it from there
+        coremap_page_begin_writeback(pframe << PAGE_SHIFT);
+        if (vm_write_file_page(coremap[pframe].file_vnode, coremap[pframe].file_offset, pframe << PAGE_SHIFT)) {
+            kprintf("swap: lost a write to a shared file mapping\n");
+        }
+        for (r = coremap[pframe].rmap; r != NULL; r = r->next) {
+            r->pte->valid = 0;
+        }
+        coremap_page_swap_out(pframe << PAGE_SHIFT);
+        swap_file_writes++;
+    } else {
+        if (swap_avail_page == 0) { // We are out of swap -> out of memory
+            return ENOMEM;
+        }
 
         // Allocate a page in swap file
         unsigned int file_frame = swap_alloc_page();
 
         // Swap out the page
+        coremap_page_set_busy(pframe << PAGE_SHIFT);
         swap_store_page(pframe << PAGE_SHIFT, file_frame);
 
-        struct page_table_entry *e = coremap[pframe].ptes[i];
-        e->cow = 0; // No copy-on-write anymore
-        e->swapped = 1;
-        e->swap_file_frame = file_frame;
+        swap_unmap_frame(pframe, file_frame); // This also releases the page
+        swap_writes++;
     }
-    coremap_page_swap_out(pframe << PAGE_SHIFT);
 
     return 0;
 }
 
 unsigned int
-swap_evict_avoidance(unsigned int avoid_pframe)
+swap_evict(void)
 {
     assert(curspl>0); // Make sure interrupt is disabled
 
-    if (swap_avail_page == 0) { // We are out of swap -> out of memory
-        return ENOMEM;
-    }
-
     // Figure out which page to be removed from memory
-    unsigned int pframe = coremap_page_to_evict_avoidance(avoid_pframe);
+    unsigned int pframe = coremap_page_to_evict();
+    while (pframe >= coremap_get_page_count()) { // Nothing to evict right now
+        // Every candidate is in the middle of someone else's I/O, they come back once it's done
+        if (coremap_wait_busy_pages()) {
+            return ENOMEM;
+        }
+        if (coremap_get_avail_page_count() > 0) { // A page-out freed a page for us
+            return 0;
+        }
+        pframe = coremap_page_to_evict();
+    }
 
-    // Update all the ptes because when swaping out page, we can't have shared pages anymore
-    unsigned int i;
-    for (i = 0; i < coremap[pframe].ref_count; i++) {
-        assert(i == 0); // Not testing i > 0 yet
+    return swap_evict_frame(pframe);
+}
 
-        // Allocate a page in swap file
-        unsigned int file_frame = swap_alloc_page();
+unsigned int
+swap_evict_specific(unsigned int pframe)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
 
-        // Swap out the page
-        swap_store_page(pframe << PAGE_SHIFT, file_frame);
+    return swap_evict_frame(pframe);
+}
 
-        struct page_table_entry *e = coremap[pframe].ptes[i];
-        e->cow = 0; // No copy-on-write anymore
-        e->swapped = 1;
-        e->swap_file_frame = file_frame;
+// Find npages free swap slots in a row and take them, next-fit from where the last cluster ended
+static
+int
+swap_alloc_cluster(unsigned int npages, unsigned int *start)
+{
+    unsigned int scanned, j;
+    unsigned int run = 0;
+    lock_acquire(swap_lock);
+    unsigned int i = swap_cluster_hint;
+    for (scanned = 0; scanned < swapsize; scanned++, i = (i + 1) % swapsize) {
+        if (i == 0) { // Runs can't wrap around the end of the swap file
+            run = 0;
+        }
+        if (bitmap_isset(swap_table, i)) {
+            run = 0;
+            continue;
+        }
+        run++;
+        if (run == npages) {
+            *start = i + 1 - npages;
+            for (j = *start; j <= i; j++) {
+                bitmap_mark(swap_table, j);
+                swap_refs[j] = 1;
+            }
+            swap_avail_page -= npages;
+            swap_cluster_hint = (i + 1) % swapsize;
+            lock_release(swap_lock);
+            return 0;
+        }
     }
-    coremap_page_swap_out(pframe << PAGE_SHIFT);
-
-    return 0;
+    lock_release(swap_lock);
+    return ENOSPC;
 }
 
 unsigned int
-swap_evict_specific(unsigned int pframe)
+swap_evict_batch(unsigned int npages, unsigned int *evicted)
 {
     assert(curspl>0); // Make sure interrupt is disabled
 
-    if (swap_avail_page == 0) { // We are out of swap -> out of memory
-        return ENOMEM;
+    unsigned int victims[SWAP_CLUSTER];
+    unsigned int nvictims = 0;
+    unsigned int i;
+
+    *evicted = 0;
+    if (npages > SWAP_CLUSTER) {
+        npages = SWAP_CLUSTER;
     }
 
-    // Update all the ptes because when swaping out page, we can't have shared pages anymore
-    unsigned int i;
-    for (i = 0; i < coremap[pframe].ref_count; i++) {
-        assert(i == 0); // Not testing i > 0 yet
+    // 1. Pick the victims, clean pages need no I/O and go right away
+    // 2. Dirty ones are marked busy so the clock doesn't pick them twice, and unloaded so nobody writes to them
+    while (*evicted + nvictims < npages) {
+        unsigned int pframe = coremap_page_to_evict();
+        if (pframe >= coremap_get_page_count()) { // Nothing else we can evict
+            break;
+        }
+        if ((!swap_frame_dirty(pframe) && (coremap[pframe].swap_slot >= 0 || coremap[pframe].file_backed || coremap[pframe].zero_fill))
+            || coremap[pframe].file_vnode != NULL) { // Shared file pages never go to swap
+            swap_evict_frame(pframe);
+            (*evicted)++;
+            continue;
+        }
+        coremap_page_set_busy(pframe << PAGE_SHIFT);
+        coremap_page_unload(pframe);
+        victims[nvictims++] = pframe;
+    }
 
-        // Allocate a page in swap file
-        unsigned int file_frame = swap_alloc_page();
+    // 3. One contiguous run of slots for all of them, shrink the batch if swap is too fragmented
+    unsigned int start = 0;
+    while (nvictims > 0 && swap_alloc_cluster(nvictims, &start)) {
+        nvictims--;
+        coremap_page_clear_busy(victims[nvictims] << PAGE_SHIFT); // Stays in memory
+    }
+    if (nvictims == 0) {
+        return (*evicted > 0) ? 0 : ENOMEM;
+    }
 
-        // Swap out the page
-        swap_store_page(pframe << PAGE_SHIFT, file_frame);
+    // 4. Write them all with one request, the pages stay busy until the write is done
+    lock_acquire(swap_buffer_lock);
+    for (i = 0; i < nvictims; i++) {
+        memmove(swap_buffer + i * PAGE_SIZE, (const void *)PADDR_TO_KVADDR(victims[i] << PAGE_SHIFT), PAGE_SIZE);
+    }
+    struct uio u;
+    mk_kuio(&u, swap_buffer, nvictims * PAGE_SIZE, start << PAGE_SHIFT, UIO_WRITE);
+    if (swap_io(&u)) {
+        panic("swap_evict_batch failed\n");
+    }
+    lock_release(swap_buffer_lock);
 
-        struct page_table_entry *e = coremap[pframe].ptes[i];
-        e->cow = 0; // No copy-on-write anymore
-        e->swapped = 1;
-        e->swap_file_frame = file_frame;
+    // 5. Point the ptes to their slots and free the frames, this wakes up whoever waited on them
+    for (i = 0; i < nvictims; i++) {
+        swap_unmap_frame(victims[i], start + i);
     }
-    coremap_page_swap_out(pframe << PAGE_SHIFT);
+    swap_writes += nvictims;
+    swap_cluster_writes++;
+    *evicted += nvictims;
 
     return 0;
 }
+
+void
+swap_stats(void)
+{
+    kprintf("Swap: %u of %u pages free, %u pages written(%u batched writes), %u clean pages dropped, %u written back to files\n",
+        swap_avail_page, swapsize, swap_writes, swap_cluster_writes, swap_clean_drops, swap_file_writes);
+}
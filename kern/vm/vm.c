@@ -9,79 +9,472 @@
 #include <coremap.h>
 #include <swap.h>
 #include <vm.h>
+#include <pageout.h>
+#include <pagezero.h>
+#include <vnode.h>
+#include <kern/stat.h>
+#include <kern/mman.h>
 #include <machine/spl.h>
 #include <machine/tlb.h>
 
-struct lock *vm_fault_lock;
 static int vm_bootstrap_flag = 0;
 
-static paddr_t vm_alloc_page(struct page_table_entry *e)
+// TLB refill counters, fast refills are resolved without going through fault_handler
+static unsigned int vm_fast_refills = 0;
+static unsigned int vm_slow_refills = 0;
+
+// TLB miss counters, misses are refills of a page with no TLB entry, not dirty bit upgrades
+// Batched are entries loaded for neighbours of a miss, prefaulted are anonymous pages set up with a block fault
+static unsigned int vm_tlb_misses = 0;
+static unsigned int vm_tlb_batched = 0;
+static unsigned int vm_prefaulted = 0;
+
+// Pages in an aligned fault block, a miss loads the resident neighbours in its block and a first
+// touch of an anonymous page sets up the whole block, 1 turns both off
+#define VM_BLOCK_MAX 16
+static unsigned int vm_block_pages = 8;
+
+// Get a user page for the pte, zeroed for pages that have nothing to be loaded from
+static paddr_t vm_alloc_page(struct addrspace *as, struct page_table_entry *e, unsigned int zeroed)
 {
-    if (coremap_get_avail_page_count() == 0) { // Now we need to evict
+    if (coremap_get_avail_page_count() == 0) { // Now we need to evict, the pageout daemon didn't keep up
+        pageout_stall();
         if (swap_evict()) {
-            lock_release(swap_lock);
             return NULL;
         }
     }
-    paddr_t paddr = coremap_alloc_upage(e);
+    paddr_t paddr = zeroed ? coremap_alloc_zeroed_upage(as, e) : coremap_alloc_upage(as, e); // Busy until the caller is done with it
     return paddr;
 }
 
+// Read a page of a segment from the executable, with interrupt enabled during the disk I/O
+// The page is busy so nobody else touches it meanwhile
 static
 int
-fault_handler(vaddr_t faultaddress, int faulttype, int segment_index, unsigned int permission, struct addrspace *as)
+vm_load_segment_page(struct as_segment *seg, vaddr_t vaddr, paddr_t paddr)
+{
+    assert(coremap_page_busy(paddr));
+    int spl = spl0();
+    int err = load_page_on_demand(seg->vnode, seg->uio, vaddr - seg->vbase, paddr);
+    splx(spl);
+    return err;
+}
+
+// Where a page of a mapping sits in its file
+static
+off_t
+vm_file_offset(struct as_segment *seg, vaddr_t vaddr)
+{
+    return seg->uio.uio_offset + (vaddr - seg->vbase);
+}
+
+// Frame already holding a page of a shared mapping for some other mapping of the file, 0 if there is none
+// A frame still being read or written back is waited for
+static
+paddr_t
+vm_shared_file_page(struct as_segment *seg, vaddr_t vaddr)
+{
+    off_t offset = vm_file_offset(seg, vaddr);
+    paddr_t paddr = coremap_find_file_page(seg->vnode, offset);
+    while (paddr != 0 && coremap_page_busy(paddr)) {
+        coremap_page_wait(paddr);
+        paddr = coremap_find_file_page(seg->vnode, offset);
+    }
+    return paddr;
+}
+
+int
+vm_write_file_page(struct vnode *v, off_t offset, paddr_t paddr)
+{
+    struct stat st;
+    struct uio u;
+    int err;
+
+    int spl = spl0();
+    err = VOP_STAT(v, &st);
+    if (err == 0 && offset < st.st_size) {
+        // A mapping can reach past the end of the file, that part is never written
+        size_t len = (st.st_size - offset > PAGE_SIZE) ? PAGE_SIZE : (size_t)(st.st_size - offset);
+        mk_kuio(&u, (void *)PADDR_TO_KVADDR(paddr), len, offset, UIO_WRITE);
+        err = VOP_WRITE(v, &u);
+    }
+    splx(spl);
+    return err;
+}
+
+int
+vm_sync_segment(struct addrspace *as, struct as_segment *seg)
 {
-    lock_acquire(vm_fault_lock);
     assert(curspl>0); // Make sure interrupt is disabled
+    assert(lock_do_i_hold(as->as_lock));
+    assert(seg->flags & AS_SEG_SHARED);
+
+    int err = 0;
+    unsigned int i;
+    for (i = 0; i < seg->npages; i++) {
+        vaddr_t va = seg->vbase + i * PAGE_SIZE;
+        struct page_table_entry *e = as_pte_lookup(as, va);
+        while (e != NULL && coremap_page_busy(e->pframe << PAGE_SHIFT)) {
+            // Being read, or written back by eviction or another mapping
+            coremap_page_wait(e->pframe << PAGE_SHIFT);
+            e = as_pte_lookup(as, va);
+        }
+        if (e == NULL) {
+            continue;
+        }
+        assert(!e->swapped); // Shared file pages go back to the file, never to swap
+        paddr_t paddr = e->pframe << PAGE_SHIFT;
+        if (coremap_page_begin_writeback(paddr)) {
+            int result = vm_write_file_page(seg->vnode, vm_file_offset(seg, va), paddr);
+            if (result) {
+                e->dirty = 1; // Still not on disk, try again next time
+                err = result;
+            }
+            coremap_page_clear_busy(paddr);
+        }
+    }
+    return err;
+}
 
+// Load a translation into TLB, replace the entry for the page if there is one already,
+// otherwise use an invalid slot first and a random one if TLB is full(tlb_insert)
+// This also marks the physical page as referenced for the page replacement clock
+static
+void
+tlb_insert(u_int32_t new_ehi, u_int32_t new_elo)
+{
     u_int32_t ehi, elo;
+    int i;
+
+    for (i=0; i<NUM_TLB; i++) {
+        TLB_Read(&ehi, &elo, i);
+        if (elo & TLBLO_VALID) {
+            continue;
+        }
+        TLB_Write(new_ehi, new_elo, i);
+        return;
+    }
+    TLB_Random(new_ehi, new_elo);
+}
+
+// Whether a page may go into the TLB writable: it has been written(dirty), isn't shared copy-on-write,
+// and its mapping has PROT_WRITE. A dirty page of a read-only segment can't happen, but never let one through
+static
+int
+vm_pte_writable(struct page_table_entry *e)
+{
+    return !e->cow && e->dirty && (e->permission & PROT_WRITE);
+}
+
+static
+void
+tlb_load(struct addrspace *as, vaddr_t faultaddress, paddr_t paddr, unsigned int writable)
+{
+    coremap_page_referenced(paddr);
+
+    u_int32_t new_ehi = as_tlbhi(as, faultaddress);
+    u_int32_t new_elo = writable ? (paddr | TLBLO_DIRTY | TLBLO_VALID) : (paddr | TLBLO_VALID);
+
+    int i = TLB_Probe(new_ehi, 0); // elo not used pass 0
+    if (i >= 0) { // Upgrading a read-only entry, never have two entries for the same page
+        TLB_Write(new_ehi, new_elo, i);
+        return;
+    }
+    tlb_insert(new_ehi, new_elo);
+}
+
+// Load the resident neighbours of a missed page that sit in the same aligned block
+// The TLB only maps 4K pages, so a run of pages costs a run of entries, but it costs one trap instead of one each
+// Busy and swapped pages are left to their own faults, copy-on-write pages go in read-only like on a fault
+// The caller runs with interrupts off, page table entries are consistent whenever we get to run
+static
+void
+tlb_load_block(struct addrspace *as, vaddr_t faultaddress)
+{
+    if (vm_block_pages <= 1) {
+        return;
+    }
+
+    vaddr_t base = faultaddress & ~(vm_block_pages * PAGE_SIZE - 1);
+    unsigned int n;
+    for (n = 0; n < vm_block_pages; n++) {
+        vaddr_t va = base + n * PAGE_SIZE;
+        if (va == faultaddress) {
+            continue;
+        }
+        struct page_table_entry *e = as_pte_lookup(as, va);
+        if (e == NULL || e->swapped || e->permission == PROT_NONE || coremap_page_busy(e->pframe << PAGE_SHIFT)) {
+            continue;
+        }
+        u_int32_t ehi = as_tlbhi(as, va);
+        if (TLB_Probe(ehi, 0) >= 0) {
+            continue;
+        }
+        paddr_t paddr = e->pframe << PAGE_SHIFT;
+        coremap_page_referenced(paddr);
+        tlb_insert(ehi, vm_pte_writable(e) ? (paddr | TLBLO_DIRTY | TLBLO_VALID) : (paddr | TLBLO_VALID));
+        vm_tlb_batched++;
+    }
+}
+
+// Record the first write to a page, TLB entries stay read-only until then so clean pages can be dropped on eviction
+static
+void
+vm_page_dirty(struct page_table_entry *e)
+{
+    if (!e->dirty) {
+        e->dirty = 1;
+        coremap_page_dirty(e->pframe << PAGE_SHIFT);
+    }
+}
+
+// Lightweight TLB refill for pages that are already resident
+// This also takes care of the first write to a clean page(dirty bit upgrade)
+// Anything that needs work (swapped, copy-on-write, not yet faulted in) returns 0 and goes to the slow path
+// So do accesses the mapping doesn't allow, the slow path turns them into EFAULT
+// We don't take the address space lock here, a page in the middle of I/O or a copy is busy and we leave it to the slow path
+// Anything else is consistent whenever we get to run, nobody sleeps with a page half updated
+static
+int
+fast_refill(vaddr_t faultaddress, int faulttype, struct addrspace *as)
+{
+    assert(curspl>0); // Make sure interrupt is disabled
+
+    struct page_table_entry *e = as_pte_lookup(as, faultaddress);
+    if (e == NULL || e->swapped || e->cow || coremap_page_busy(e->pframe << PAGE_SHIFT)) {
+        return 0;
+    }
+    if (e->permission == PROT_NONE || (faulttype != VM_FAULT_READ && !(e->permission & PROT_WRITE))) {
+        return 0;
+    }
+
+    if (faulttype != VM_FAULT_READ) {
+        vm_page_dirty(e);
+    }
+    // Neighbours first, a random replacement while loading them mustn't throw out the entry we trapped for
+    if (faulttype != VM_FAULT_READONLY) {
+        tlb_load_block(as, faultaddress);
+    }
+    tlb_load(as, faultaddress, e->pframe << PAGE_SHIFT, vm_pte_writable(e));
+    vm_fast_refills++;
+    return 1;
+}
+
+// Largest read-ahead window in pages, also bounded by one swap cluster per read
+#define RA_MAX_WINDOW SWAP_CLUSTER
+
+// Read ahead the pages following a fault that had to go to disk
+// The window doubles while faults keep landing right after the last read-ahead and halves otherwise
+// Only free frames above the pageout low watermark are used, we never evict for a guess
+// Pages already in memory are skipped, swapped pages in consecutive swap slots are read with one request
+static
+void
+fault_around(struct addrspace *as, vaddr_t faultaddress, struct as_segment *seg)
+{
+    assert(lock_do_i_hold(as->as_lock));
+
+    if (faultaddress == as->as_ra_next) {
+        as->as_ra_window = (as->as_ra_window == 0) ? 1 : as->as_ra_window * 2;
+        if (as->as_ra_window > RA_MAX_WINDOW) {
+            as->as_ra_window = RA_MAX_WINDOW;
+        }
+    } else {
+        as->as_ra_window /= 2;
+    }
+
+    // Pages that were never touched only exist in the executable, heap and stack pages can only come from swap
+    vaddr_t top = seg->vbase + seg->npages * PAGE_SIZE;
+
+    unsigned int n = 1;
+    while (n <= as->as_ra_window) {
+        vaddr_t va = faultaddress + n * PAGE_SIZE;
+        if (va >= top || pageout_spare_pages() == 0) {
+            break;
+        }
+
+        struct page_table_entry *e = as_pte_lookup(as, va);
+        if (e == NULL) {
+            if (seg->vnode == NULL) {
+                break;
+            }
+            if ((seg->flags & AS_SEG_SHARED) && coremap_find_file_page(seg->vnode, vm_file_offset(seg, va)) != 0) {
+                n++; // Another mapping has it, the fault will share it
+                continue;
+            }
+            e = as_pte_create(as, va);
+            if (e == NULL || pageout_spare_pages() == 0) { // The table might have taken our last spare page
+                break;
+            }
+            paddr_t paddr = coremap_alloc_upage(as, e);
+            if (paddr == 0) {
+                break;
+            }
+            if (seg->flags & AS_SEG_SHARED) {
+                if (coremap_find_file_page(seg->vnode, vm_file_offset(seg, va)) != 0) { // Read by someone else meanwhile
+                    coremap_free_page(paddr, e);
+                    break;
+                }
+                coremap_page_file_shared(paddr, seg->vnode, vm_file_offset(seg, va));
+            }
+            e->vframe = va >> PAGE_SHIFT;
+            e->pframe = paddr >> PAGE_SHIFT;
+            e->permission = seg->permission;
+            e->cow = 0;
+            e->swapped = 0;
+            e->dirty = 0;
+            e->valid = 1;
+            if (vm_load_segment_page(seg, va, paddr)) {
+                // Leave it for the real fault to report
+                e->valid = 0;
+                coremap_free_page(paddr, e);
+                break;
+            }
+            coremap_page_file_backed(paddr); // No-op for shared pages, already registered
+            coremap_page_prefetched(paddr);
+            coremap_page_clear_busy(paddr);
+            n++;
+        } else if (e->swapped) {
+            // Gather the run of following pages that sit in consecutive swap pages
+            paddr_t paddrs[RA_MAX_WINDOW];
+            struct page_table_entry *ptes[RA_MAX_WINDOW];
+            unsigned int file_frame = e->swap_file_frame;
+            unsigned int count = 0;
+            unsigned int spare = pageout_spare_pages();
+            while (n + count <= as->as_ra_window && count < spare) {
+                vaddr_t next = va + count * PAGE_SIZE;
+                struct page_table_entry *ne = (next < top) ? as_pte_lookup(as, next) : NULL;
+                if (ne == NULL || !ne->swapped || ne->swap_file_frame != file_frame + count) {
+                    break;
+                }
+                ptes[count] = ne;
+                paddrs[count] = coremap_alloc_upage(as, ne);
+                if (paddrs[count] == 0) {
+                    break;
+                }
+                count++;
+            }
+            if (count == 0) { // Couldn't get a frame for even the first one, trying the same page again won't help
+                break;
+            }
+            swap_load_pages(file_frame, count, paddrs, ptes);
+            unsigned int i;
+            for (i = 0; i < count; i++) {
+                coremap_page_prefetched(paddrs[i]);
+                coremap_page_clear_busy(paddrs[i]);
+            }
+            n += count;
+        } else {
+            n++; // Already in memory
+        }
+    }
+    as->as_ra_next = faultaddress + n * PAGE_SIZE;
+}
+
+// Set up the untouched pages of an anonymous segment around a first touch, one aligned block at a time
+// A write gives each of them a zeroed frame and a read maps the zero page, like their own faults would
+// The frames stay clean until they are written, if they are evicted before that they go back to the zero page
+// Only free frames above the pageout low watermark are used, same as read-ahead
+static
+void
+vm_prefault_block(struct addrspace *as, vaddr_t faultaddress, struct as_segment *seg, unsigned int write)
+{
+    assert(lock_do_i_hold(as->as_lock));
+
+    if (vm_block_pages <= 1) {
+        return;
+    }
+
+    vaddr_t base = faultaddress & ~(vm_block_pages * PAGE_SIZE - 1);
+    vaddr_t top = seg->vbase + seg->npages * PAGE_SIZE;
+    unsigned int n;
+    for (n = 0; n < vm_block_pages; n++) {
+        vaddr_t va = base + n * PAGE_SIZE;
+        if (va == faultaddress || va < seg->vbase || va >= top || as_pte_lookup(as, va) != NULL) {
+            continue;
+        }
+        if (write && pageout_spare_pages() <= 1) { // Keep one for the rmap node
+            break;
+        }
+        struct page_table_entry *e = as_pte_create(as, va);
+        if (e == NULL) {
+            break;
+        }
+        paddr_t paddr = coremap_zero_page();
+        if (write) {
+            if (pageout_spare_pages() <= 1) { // The table might have taken our spare pages
+                break;
+            }
+            paddr = coremap_alloc_zeroed_upage(as, e);
+            if (paddr == 0) {
+                break;
+            }
+        }
+        e->vframe = va >> PAGE_SHIFT;
+        e->pframe = paddr >> PAGE_SHIFT;
+        e->permission = seg->permission;
+        e->cow = !write;
+        e->swapped = 0;
+        e->dirty = 0; // Nobody wrote to it yet, the first write marks it like any clean page
+        e->valid = 1;
+        if (write) {
+            coremap_page_zero_fill(paddr);
+            coremap_page_clear_busy(paddr);
+        }
+        vm_prefaulted++;
+    }
+}
+
+// Faults of one address space are serialized by its lock, faults of different processes only meet at busy pages
+// Interrupts are on during disk I/O, so other processes run while we wait for the disk
+static
+int
+fault_handler(vaddr_t faultaddress, int faulttype, struct as_segment *seg, struct addrspace *as)
+{
+    lock_acquire(as->as_lock);
+    assert(curspl>0); // Make sure interrupt is disabled
+    as->as_faults++;
+
+    u_int32_t ehi;
 
     paddr_t paddr = 0;
-    unsigned int cow_flag;
-    int found_flag = 0;
-    struct array *a = as->page_table;
 
     // This is to make sure we generate the right type of error, becuase we do on-demand paging
     if (faulttype == VM_FAULT_WRITE && swap_get_avail_page_count() <= 100) {
-        lock_release(vm_fault_lock);
+        lock_release(as->as_lock);
         return ENOMEM;
     }
 
-    // Iterate through our array and find the page table entry
-    int i, err;
-    struct page_table_entry *e;
-    for (i = 0; i < array_getnum(a); i++) {
-        e = array_getguy(a, i);
-        if ((vaddr_t)(e->vframe << PAGE_SHIFT) == faultaddress) { // We found the page
-            found_flag = 1;
-            break;
-        }
+    // Find the page table entry, this is a constant time walk of the two level table
+    int err;
+    struct page_table_entry *e = as_pte_lookup(as, faultaddress);
+
+    // The page is on its way to swap or being copied by a sharer, wait and see where it ended up
+    while (e != NULL && !e->swapped && coremap_page_busy(e->pframe << PAGE_SHIFT)) {
+        coremap_page_wait(e->pframe << PAGE_SHIFT);
+        e = as_pte_lookup(as, faultaddress);
     }
 
-    if (found_flag) { // We found the page in page table
+    if (e != NULL) { // We found the page in page table
         if (e->swapped) {// If the page was swapped out, now we need to load this page back in
-            if (faulttype == VM_FAULT_READONLY) { // Here we detected a write on shared page
-                assert(0);
-                // Here we really need copy on write with swap
-            } else {
-                // We need to bring the page back in from swap
-                // 1. Check if we have free page in memory
-                // 2. If we do just load the page
-                // 3. if we don't we evict and load the page
-
-                paddr = vm_alloc_page(e);
-                if (paddr == NULL) {
-                    lock_release(vm_fault_lock);
-                    return ENOMEM;
-                }
-                e->pframe = paddr >> PAGE_SHIFT;
-                swap_load_page(paddr, e->swap_file_frame, e);
-
-                assert(e->cow == 0); // Page from swap should not be cow
-                cow_flag = e->cow;
+            // We need to bring the page back in from swap
+            // 1. Check if we have free page in memory
+            // 2. If we do just load the page
+            // 3. if we don't we evict and load the page
+            // A copy-on-write page might still be shared in swap with other address spaces,
+            // swap_load_page gives us a private frame so a write needs no extra copy
+
+            paddr = vm_alloc_page(as, e, 0);
+            if (paddr == NULL) {
+                lock_release(as->as_lock);
+                return ENOMEM;
             }
+            swap_load_page(paddr, e->swap_file_frame, e); // This also points the entry to the new page, clean
+            as->as_major_faults++;
+            coremap_page_clear_busy(paddr);
+
+            fault_around(as, faultaddress, seg);
         } else {
-            if (faulttype == VM_FAULT_READONLY) { // Here we detected a write on shared page
+            if (faulttype == VM_FAULT_READONLY && e->cow) { // Here we detected a write on shared page
                 // Copy-On-Write shared page
                 // 0. (Improvement) Check if the physical page have reference count = 1, if so we don't need to allocate new page
                 // 1. Allocate a new page
@@ -90,135 +483,134 @@ fault_handler(vaddr_t faultaddress, int faulttype, int segment_index, unsigned i
                 // 4. Update page table to use the new page
                 // 5. Update the TLB entry to use the new page
 
-                if (coremap_get_page_ref_count(e->pframe << PAGE_SHIFT) == 1) {
+                if ((e->pframe << PAGE_SHIFT) == coremap_zero_page()) {
+                    // First write to an untouched stack or heap page, it gets a zeroed page of its own, nothing to copy
+                    paddr = vm_alloc_page(as, e, 1);
+                    if (paddr == 0) {
+                        lock_release(as->as_lock);
+                        return ENOMEM;
+                    }
+                    e->pframe = paddr >> PAGE_SHIFT;
+                    e->dirty = 0; // Marked below
+                    coremap_page_clear_busy(paddr);
+                } else if (coremap_get_page_ref_count(e->pframe << PAGE_SHIFT) == 1) {
                     paddr = e->pframe << PAGE_SHIFT;
                 } else {
-                    if (coremap_get_avail_page_count() == 0) { // Now we need to evict
-                        err = swap_evict_avoidance(e->pframe);
-                        if (err) {
-                            lock_release(vm_fault_lock);
-                            return err;
-                        }
+                    // Pin the old page, allocating can sleep on an eviction and it must still be here when we copy
+                    paddr_t old_paddr = e->pframe << PAGE_SHIFT;
+                    coremap_page_set_busy(old_paddr);
+                    paddr = vm_alloc_page(as, e, 0);
+                    if (paddr == 0) {
+                        coremap_page_clear_busy(old_paddr);
+                        lock_release(as->as_lock);
+                        return ENOMEM;
                     }
-                    paddr = coremap_alloc_upage(e);
-                    memmove((void *)PADDR_TO_KVADDR(paddr), (const void *)PADDR_TO_KVADDR(e->pframe << PAGE_SHIFT), PAGE_SIZE);
-                    coremap_free_page(e->pframe << PAGE_SHIFT, e); // Try to free the old page
+                    memmove((void *)PADDR_TO_KVADDR(paddr), (const void *)PADDR_TO_KVADDR(old_paddr), PAGE_SIZE);
+                    coremap_page_clear_busy(old_paddr);
+                    coremap_free_page(old_paddr, e); // Try to free the old page
                     e->pframe = paddr >> PAGE_SHIFT;
+                    e->dirty = 0; // Fresh frame, nothing to forget in swap, marked below
+                    coremap_page_clear_busy(paddr);
                 }
                 e->cow = 0; // No copy-on-write anymore
-                cow_flag = e->cow;
-                ehi = faultaddress & TLBHI_VPAGE; // Set the pid field to 0
+                ehi = as_tlbhi(as, faultaddress);
                 int tlb_index = TLB_Probe(ehi, 0); // eho not used pass 0
                 if (tlb_index >= 0) {
                     TLB_Write(TLBHI_INVALID(tlb_index), TLBLO_INVALID(), tlb_index);
                 }
             } else {
-                // Here we have a simple TLB miss and the page is in memory already
+                // Here we have a simple TLB miss(or a first write) and the page is in memory already
                 paddr = e->pframe << PAGE_SHIFT;
-                cow_flag = e->cow;
             }
         }
     } else {
         // Below is on-demand paging
-        // Here the order is very important, because both kmalloc and array_add might require additional page, and we can't have incomplete data structures
-        struct page_table_entry *entry = kmalloc(sizeof(struct page_table_entry)); // This might kick out the page that we just allocated, if done in the wrong order
-        if (entry == NULL) {
-            lock_release(vm_fault_lock);
+        // Here the order is very important, the second level table might need a new kernel page which can evict,
+        // so get the slot before allocating the user page we are about to fill
+        e = as_pte_create(as, faultaddress);
+        if (e == NULL) {
+            lock_release(as->as_lock);
             return ENOMEM;
         }
-        if (array_getmax(a) < array_getnum(a) + 1) {
-            err = array_preallocate(a, array_getnum(a) + 1); // We preallocate here so later array_add will not evict
-            if (err) {
-                lock_release(vm_fault_lock);
-                return err;
-            }
-        }
 
-        paddr_t new_page = vm_alloc_page(entry);
-        if (new_page == NULL) {
-            lock_release(vm_fault_lock);
-            return ENOMEM;
-        }
-
-        entry->vframe = faultaddress >> PAGE_SHIFT;
-        entry->pframe = new_page >> PAGE_SHIFT;
-        entry->permission = permission;
-        entry->cow = 0; // No copy-on-write
-        entry->swapped = 0;
-        entry->swap_file_frame = -1;
-        err = array_add(a, entry); // This array_add must not allocate new page, if that is the case then the page we just allocated still might get swapped out
-        if (err) {
-            lock_release(vm_fault_lock);
-            return err;
-        }
-
-        // Now change paddr
-        paddr = entry->pframe << PAGE_SHIFT;
-        cow_flag = entry->cow;
-        lock_release(vm_fault_lock);
-
-        if (segment_index >= 0) { // Page haven't been read from disk yet
-            // Add entry into TLB so we can load page
-            err = 1;
-            for (i=0; i<NUM_TLB; i++) {
-                TLB_Read(&ehi, &elo, i);
-                if (elo & TLBLO_VALID) {
-                    continue;
+        int shared_hit = 0;
+        if (seg->vnode == NULL && faulttype == VM_FAULT_READ) {
+            // Reading a stack or heap page nobody wrote yet, map the shared zero page until the first write
+            paddr = coremap_zero_page();
+        } else {
+            for (;;) {
+                if ((seg->flags & AS_SEG_SHARED) && (paddr = vm_shared_file_page(seg, faultaddress)) != 0) {
+                    // Another mapping of the file has the page already, everybody shares one frame
+                    if (coremap_page_share(paddr, as, e)) {
+                        lock_release(as->as_lock);
+                        return ENOMEM;
+                    }
+                    shared_hit = 1;
+                    break;
                 }
-                ehi = faultaddress;
-                if (cow_flag) {
-                    elo = paddr | TLBLO_VALID;
-                } else {
-                    elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+                paddr = vm_alloc_page(as, e, seg->vnode == NULL); // Stack and heap pages start out zeroed
+                if (paddr == NULL) {
+                    lock_release(as->as_lock);
+                    return ENOMEM;
                 }
-                TLB_Write(ehi, elo, i);
-                err = 0;
-                break;
-            }
-            if (err) {
-                ehi = faultaddress;
-                if (cow_flag) {
-                    elo = paddr | TLBLO_VALID;
-                } else {
-                    elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+                if (!(seg->flags & AS_SEG_SHARED)) {
+                    break;
                 }
-                TLB_Random(ehi, elo);
+                if (coremap_find_file_page(seg->vnode, vm_file_offset(seg, faultaddress)) == 0) {
+                    // Registered before the read, so other mappings wait for us instead of reading it again
+                    coremap_page_file_shared(paddr, seg->vnode, vm_file_offset(seg, faultaddress));
+                    break;
+                }
+                coremap_free_page(paddr, e); // Allocating slept and someone else read it meanwhile, use theirs
             }
+        }
 
-            struct as_segment *seg = array_getguy(as->as_segments, segment_index);
-            err = load_page_on_demand(seg->vnode, seg->uio, faultaddress - seg->vbase);
+        e->vframe = faultaddress >> PAGE_SHIFT;
+        e->pframe = paddr >> PAGE_SHIFT;
+        e->permission = seg->permission;
+        e->cow = (paddr == coremap_zero_page()); // Only the zero page is copy-on-write
+        e->swapped = 0;
+        e->valid = 1;
+
+        if (shared_hit) {
+            e->dirty = 0;
+        } else if (seg->vnode != NULL) { // Page haven't been read from disk yet
+            // Read it straight into the frame, it stays busy until it's filled so the frame can't be taken from us
+            // The page stays clean, while it is it can always be read again from the executable
+            err = vm_load_segment_page(seg, faultaddress, paddr);
+            coremap_page_clear_busy(paddr);
+            as->as_major_faults++;
             if (err) {
+                lock_release(as->as_lock);
                 return err;
             }
-            return 0;
+            e->dirty = 0;
+            coremap_page_file_backed(paddr);
+
+            fault_around(as, faultaddress, seg);
+        } else if (e->cow) {
+            e->dirty = 0; // Nothing to write back, the zero page never leaves memory
+            vm_prefault_block(as, faultaddress, seg, 0);
+        } else {
+            e->dirty = 1; // Stack and heap pages have no backing store, they always go to swap
+            vm_prefault_block(as, faultaddress, seg, 1); // While our page is still busy, it can't be evicted under us
+            coremap_page_clear_busy(paddr);
         }
     }
-    lock_release(vm_fault_lock);
+
+    if (faulttype != VM_FAULT_READ) {
+        vm_page_dirty(e);
+    }
+    lock_release(as->as_lock);
 
     /* make sure it's page-aligned */
     assert((paddr & PAGE_FRAME)==paddr);
 
-    for (i=0; i<NUM_TLB; i++) {
-        TLB_Read(&ehi, &elo, i);
-        if (elo & TLBLO_VALID) {
-            continue;
-        }
-        ehi = faultaddress;
-        if (cow_flag) {
-            elo = paddr | TLBLO_VALID;
-        } else {
-            elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-        }
-        TLB_Write(ehi, elo, i);
-        return 0;
-    }
-    ehi = faultaddress;
-    if (cow_flag) {
-        elo = paddr | TLBLO_VALID;
-    } else {
-        elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+    // Neighbours first, so the faulting page's entry is the last one in and can't be replaced by them
+    if (faulttype != VM_FAULT_READONLY) {
+        tlb_load_block(as, faultaddress);
     }
-    TLB_Random(ehi, elo);
+    tlb_load(as, faultaddress, paddr, vm_pte_writable(e));
     return 0;
 }
 
@@ -227,12 +619,53 @@ vm_bootstrap(void)
 {
     kprintf("VM bootstrap:\n");
 
-    vm_fault_lock = lock_create("vm_fualt_lock");
+    as_bootstrap(); // kmalloc still takes memory from the boot heap here, it can't once coremap_init is done
 
     coremap_init();
-    swap_init();
 
-    vm_bootstrap_flag = 1; // Finished bootstrap
+    vm_bootstrap_flag = 1; // Finished bootstrap, kmalloc can get pages from coremap from here on
+
+    swap_init(); // The swap page table can be bigger than what is left of the boot heap
+
+    pageout_bootstrap(); // Needs kmalloc for the thread, so after the flag
+
+    pagezero_bootstrap();
+}
+
+// With an argument this sets the fault block size and starts the counters over, so runs can be compared
+int
+vm_stats(int nargs, char **arg)
+{
+    int spl = splhigh(); // Disable interrupt when printing
+    if (nargs == 2) {
+        unsigned int pages = atoi(arg[1]);
+        if (pages == 0 || pages > VM_BLOCK_MAX || (pages & (pages - 1)) != 0) {
+            splx(spl);
+            kprintf("Usage: vs [block], block is a power of 2 from 1 to %u pages\n", VM_BLOCK_MAX);
+            return EINVAL;
+        }
+        vm_block_pages = pages;
+        vm_fast_refills = vm_slow_refills = 0;
+        vm_tlb_misses = vm_tlb_batched = vm_prefaulted = 0;
+    } else if (nargs != 1) {
+        splx(spl);
+        kprintf("Usage: vs [block]\n");
+        return EINVAL;
+    }
+
+    unsigned int total = vm_fast_refills + vm_slow_refills;
+    kprintf("TLB refills: %u fast, %u slow", vm_fast_refills, vm_slow_refills);
+    if (total > 0) {
+        kprintf(" (%u%% fast)", vm_fast_refills * 100 / total);
+    }
+    kprintf("\n");
+    kprintf("TLB misses: %u, %u entries batched, %u pages prefaulted (block %u pages)\n",
+            vm_tlb_misses, vm_tlb_batched, vm_prefaulted, vm_block_pages);
+    swap_stats();
+    coremap_prefetch_stats();
+    coremap_zero_stats();
+    splx(spl);
+    return 0;
 }
 
 paddr_t
@@ -273,8 +706,12 @@ alloc_kpages(int npages)
         count = coremap_get_avail_page_count();
     }
     */
-    vaddr_t vaddr = PADDR_TO_KVADDR(coremap_alloc_kpages(npages));
+    paddr = coremap_alloc_kpages(npages);
     splx(spl);
+    if (paddr == 0) {
+        return 0;
+    }
+    vaddr_t vaddr = PADDR_TO_KVADDR(paddr);
     return vaddr;
 }
 
@@ -289,10 +726,8 @@ free_kpages(vaddr_t addr)
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-    vaddr_t vbase, vtop, stackbase, stacktop;
-    int i, err = 0;
-    int found_flag = 0;
     struct addrspace *as;
+    struct as_segment *seg;
 
     int spl = splhigh();
 
@@ -309,35 +744,25 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         return EFAULT;
     }
 
-    for (i = 0; i < array_getnum(as->as_segments); i++) {
-        struct as_segment *seg = array_getguy(as->as_segments, i);
-        vbase = seg->vbase;
-        vtop = seg->vbase + seg->npages * PAGE_SIZE;
-        if (faultaddress >= vbase && faultaddress < vtop) { // We found the region we want
-            err = fault_handler(faultaddress, faulttype, i, seg->permission, as);
-            found_flag = 1;
-            break;
-        }
+    if (faulttype != VM_FAULT_READONLY) {
+        vm_tlb_misses++;
     }
-
-    stackbase = USERSTACK - STACKPAGES * PAGE_SIZE;
-    stacktop = USERSTACK;
-
-    // Stack
-    if (faultaddress >= stackbase && faultaddress < stacktop) {
-        err = fault_handler(faultaddress, faulttype, -1, 6, as); // Read and Write
-        found_flag = 1;
+    if (fast_refill(faultaddress, faulttype, as)) {
+        return 0;
     }
+    vm_slow_refills++;
 
-    // Heap
-    if (faultaddress >= as->as_heapbase && faultaddress < as->as_heapbase + as->as_heapsize) {
-        err = fault_handler(faultaddress, faulttype, -1, 6, as); // Read and Write
-        found_flag = 1;
+    // Code, data, heap and stack are all segments, a binary search finds the one we are in
+    seg = as_segment_lookup(as, faultaddress);
+    if (seg == NULL) {
+        splx(spl);
+        return EFAULT;
     }
-
-    if (!found_flag) {
+    // Writes to code or to a mapping without PROT_WRITE, and any access to a PROT_NONE mapping
+    // Checked before anything is loaded, so a page is never marked dirty or mapped writable against its protection
+    if (seg->permission == PROT_NONE || (faulttype != VM_FAULT_READ && !(seg->permission & PROT_WRITE))) {
         splx(spl);
         return EFAULT;
     }
-    return err;
+    return fault_handler(faultaddress, faulttype, seg, as);
 }
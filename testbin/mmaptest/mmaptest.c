@@ -0,0 +1,229 @@
+/* mmaptest.c
+ *    Test program for mmap, munmap and msync.
+ *
+ *    Writes a file with read(), maps it shared and private, writes
+ *    through the mappings, then reads the file back to check that
+ *    shared writes went to the file on msync and munmap and private
+ *    ones didn't. Also checks the errors for bad arguments and for
+ *    mappings the file's open mode doesn't allow.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/mman.h>
+
+#define PAGE_SIZE  4096
+#define NPAGES     2
+#define FILESIZE   (NPAGES * PAGE_SIZE)
+
+#define FILENAME   "mmaptest.dat"
+
+static char buf[FILESIZE];
+
+/* What byte I of the file holds after the given generation of writes. */
+static
+char
+pattern(int gen, int i)
+{
+	return 'a' + (i + gen * 7) % 26;
+}
+
+static
+void
+fill(char *p, int gen)
+{
+	int i;
+	for (i=0; i<FILESIZE; i++) {
+		p[i] = pattern(gen, i);
+	}
+}
+
+static
+void
+check(const char *p, int gen, const char *what)
+{
+	int i;
+	for (i=0; i<FILESIZE; i++) {
+		if (p[i] != pattern(gen, i)) {
+			errx(1, "%s: byte %d is %d, expected %d", what, i,
+			     p[i], pattern(gen, i));
+		}
+	}
+}
+
+/* Read the whole file through a fresh handle. */
+static
+void
+readfile(void)
+{
+	int fd, r;
+
+	fd = open(FILENAME, O_RDONLY);
+	if (fd<0) {
+		err(1, "%s: open for read", FILENAME);
+	}
+	r = read(fd, buf, FILESIZE);
+	if (r<0) {
+		err(1, "%s: read", FILENAME);
+	}
+	if (r != FILESIZE) {
+		errx(1, "%s: short read (%d bytes)", FILENAME, r);
+	}
+	close(fd);
+}
+
+static
+void *
+map(int fd, int prot, int flags)
+{
+	void *p = mmap(NULL, FILESIZE, prot, flags, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	return p;
+}
+
+/* Check that a call failed with the expected error. */
+static
+void
+expect(int failed, int code, const char *what)
+{
+	if (!failed) {
+		errx(1, "%s: succeeded, expected %s", what, strerror(code));
+	}
+	if (errno != code) {
+		errx(1, "%s: got %s, expected %s", what, strerror(errno),
+		     strerror(code));
+	}
+}
+
+static
+void
+test_writeback(void)
+{
+	int fd;
+	char *p;
+
+	/* Start from a known file, written the ordinary way. */
+	fd = open(FILENAME, O_RDWR|O_CREAT|O_TRUNC);
+	if (fd<0) {
+		err(1, "%s: create", FILENAME);
+	}
+	fill(buf, 0);
+	if (write(fd, buf, FILESIZE) != FILESIZE) {
+		err(1, "%s: write", FILENAME);
+	}
+
+	/* Shared mapping: msync writes it back, the mapping stays. */
+	p = map(fd, PROT_READ|PROT_WRITE, MAP_SHARED);
+	check(p, 0, "shared mapping");
+	fill(p, 1);
+	if (msync(p, FILESIZE, MS_SYNC)) {
+		err(1, "msync");
+	}
+	readfile();
+	check(buf, 1, "file after msync");
+
+	/* Private mapping: sees the file, its writes stay private. */
+	{
+		char *q = map(fd, PROT_READ|PROT_WRITE, MAP_PRIVATE);
+		check(q, 1, "private mapping");
+		fill(q, 2);
+		check(p, 1, "shared mapping after private write");
+		if (munmap(q, FILESIZE)) {
+			err(1, "munmap private");
+		}
+	}
+	readfile();
+	check(buf, 1, "file after private write");
+
+	/* Shared writes also go back on munmap, without msync. */
+	fill(p, 3);
+	if (munmap(p, FILESIZE)) {
+		err(1, "munmap shared");
+	}
+	readfile();
+	check(buf, 3, "file after munmap");
+
+	close(fd);
+	printf("mmaptest: write-back ok\n");
+}
+
+static
+void
+test_errors(void)
+{
+	int rfd, wfd, rwfd;
+	char *p;
+
+	rfd = open(FILENAME, O_RDONLY);
+	wfd = open(FILENAME, O_WRONLY);
+	rwfd = open(FILENAME, O_RDWR);
+	if (rfd<0 || wfd<0 || rwfd<0) {
+		err(1, "%s: open", FILENAME);
+	}
+
+	/* The file's open mode has to allow the mapping. */
+	expect(mmap(NULL, FILESIZE, PROT_READ|PROT_WRITE, MAP_SHARED, rfd, 0)
+	       == MAP_FAILED, EACCES, "shared writable map of O_RDONLY file");
+	expect(mmap(NULL, FILESIZE, PROT_READ, MAP_SHARED, wfd, 0)
+	       == MAP_FAILED, EACCES, "map of O_WRONLY file");
+
+	/* A read-only shared mapping and a private writable one are fine. */
+	p = map(rfd, PROT_READ, MAP_SHARED);
+	check(p, 3, "read-only shared mapping");
+	if (munmap(p, FILESIZE)) {
+		err(1, "munmap read-only");
+	}
+	p = map(rfd, PROT_READ|PROT_WRITE, MAP_PRIVATE);
+	p[0] = pattern(4, 0);
+	if (munmap(p, FILESIZE)) {
+		err(1, "munmap private");
+	}
+
+	/* Bad arguments. */
+	expect(mmap(NULL, 0, PROT_READ, MAP_SHARED, rwfd, 0)
+	       == MAP_FAILED, EINVAL, "zero length");
+	expect(mmap(NULL, 0xfffff001, PROT_READ, MAP_SHARED, rwfd, 0)
+	       == MAP_FAILED, EINVAL, "length that overflows when rounded up");
+	expect(mmap(NULL, FILESIZE, PROT_READ, MAP_SHARED, rwfd, 100)
+	       == MAP_FAILED, EINVAL, "unaligned offset");
+	expect(mmap(NULL, FILESIZE, PROT_READ, 0, rwfd, 0)
+	       == MAP_FAILED, EINVAL, "no MAP_SHARED or MAP_PRIVATE");
+	expect(mmap(NULL, FILESIZE, PROT_READ, MAP_SHARED|MAP_PRIVATE, rwfd, 0)
+	       == MAP_FAILED, EINVAL, "both MAP_SHARED and MAP_PRIVATE");
+	expect(mmap(NULL, FILESIZE, 8, MAP_SHARED, rwfd, 0)
+	       == MAP_FAILED, EINVAL, "unknown protection bit");
+	expect(mmap(NULL, FILESIZE, PROT_READ, MAP_SHARED, 42, 0)
+	       == MAP_FAILED, EBADF, "unopened handle");
+
+	p = map(rwfd, PROT_READ|PROT_WRITE, MAP_SHARED);
+	expect(msync(p, FILESIZE, 0) != 0, EINVAL, "msync without flags");
+	expect(msync(p + 1, FILESIZE, MS_SYNC) != 0, EINVAL,
+	       "msync of unaligned address");
+	if (munmap(p, FILESIZE)) {
+		err(1, "munmap");
+	}
+
+	/* Nothing above may have changed the file. */
+	readfile();
+	check(buf, 3, "file after error checks");
+
+	close(rfd);
+	close(wfd);
+	close(rwfd);
+	printf("mmaptest: error checks ok\n");
+}
+
+int
+main(void)
+{
+	test_writeback();
+	test_errors();
+	printf("mmaptest: passed\n");
+	return 0;
+}